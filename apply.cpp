@@ -0,0 +1,170 @@
+#include "apply.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+
+using namespace aise;
+using namespace llvm;
+
+namespace
+{
+
+// eraseDead erases inst, and then its operands that are left unused.
+void eraseDead(Instruction *inst)
+{
+    // A set never holds an erased instruction twice.
+    std::set<Instruction *> pending;
+    pending.insert(inst);
+    while (!pending.empty()) {
+        Instruction *dead = *pending.begin();
+        pending.erase(pending.begin());
+        if (!dead->use_empty() || dead->mayHaveSideEffects()) {
+            continue;
+        }
+        for (unsigned i = 0, e = dead->getNumOperands(); i < e; i++) {
+            Value *operand = dead->getOperand(i);
+            if (Instruction *inst = dyn_cast<Instruction>(operand)) {
+                pending.insert(inst);
+            }
+        }
+        dead->eraseFromParent();
+    }
+}
+
+} // namespace
+
+namespace aise
+{
+
+Value *MISOApplier::valueOf(const Node *node)
+{
+    Value *val = values->find(node)->second;
+    DenseMap<Value *, Value *>::const_iterator i = replaced.find(val);
+    return i == replaced.end() ? val : i->second;
+}
+
+Function *MISOApplier::getFunction(const IntriNode *tile, FunctionType *type)
+{
+    Function *&func = functions[std::make_pair(tile->RefRPN, type)];
+    if (func) {
+        return func;
+    }
+
+    StringMap<std::string>::const_iterator n = names.find(tile->RefRPN);
+    std::string base = n == names.end() ? "aise.miso" : n->second;
+    std::string name = base;
+    for (int i = 1; module->getFunction(name); i++) {
+        name = base + '.' + ToString(i);
+    }
+
+    func = Function::Create(type, GlobalValue::ExternalLinkage, name, module);
+    func->setDoesNotAccessMemory();
+    func->setDoesNotThrow();
+    func->addFnAttr("aise-refrpn", tile->RefRPN);
+    return func;
+}
+
+void MISOApplier::Apply(const NodeArray &DAG)
+{
+    // Values defined out of these blocks are ready before the DAG.
+    std::set<const BasicBlock *> blocks;
+    NodeArray::const_iterator n = DAG.begin(), ne = DAG.end();
+    for (; n != ne; ++n) {
+        NodeValueMap::const_iterator v = values->find(*n);
+        if (!(*n)->Pred.empty() && v != values->end()) {
+            blocks.insert(cast<Instruction>(v->second)->getParent());
+        }
+    }
+
+    // A multi-output tile is in the tile list of each output, and is
+    // applied once, before its first output.
+    std::set<const IntriNode *> done;
+    for (size_t i = DAG.size(); i-- > 0;) {
+        Node *node = DAG[i];
+        if (node->TileList.empty()) {
+            continue;
+        }
+        IntriNode *tile = node->TileList.front();
+        if (tile->RefRPN.empty() || !done.insert(tile).second) {
+            continue;
+        }
+
+        NodeArray outputs(tile->Outputs);
+        if (outputs.empty()) {
+            outputs.push_back(node);
+        }
+        if (apply(tile, outputs, blocks)) {
+            applied++;
+        } else {
+            skipped++;
+        }
+    }
+}
+
+bool MISOApplier::apply(const IntriNode *tile, const NodeArray &outputs,
+                        const std::set<const BasicBlock *> &blocks)
+{
+    // Inputs of a single-output tile are always ready before its root.
+    const Node *first = outputs[0];
+    NodeArray::const_iterator o = outputs.begin(), oe = outputs.end();
+    for (; o != oe; ++o) {
+        if ((*o)->Index < first->Index) {
+            first = *o;
+        }
+    }
+
+    std::vector<Value *> args;
+    std::vector<Type *> argTypes;
+    Node::const_node_iterator p = tile->PredBegin(), pe = tile->PredEnd();
+    for (; p != pe; ++p) {
+        Value *arg = valueOf(*p);
+        Instruction *inst = dyn_cast<Instruction>(arg);
+        if ((*p)->Index > first->Index && inst &&
+            blocks.find(inst->getParent()) != blocks.end()) {
+            return false;
+        }
+        args.push_back(arg);
+        argTypes.push_back(arg->getType());
+    }
+    NodeArray::const_iterator m = tile->Immediates.begin();
+    for (; m != tile->Immediates.end(); ++m) {
+        args.push_back(valueOf(*m));
+        argTypes.push_back(args.back()->getType());
+    }
+
+    std::vector<Type *> outputTypes;
+    for (o = outputs.begin(); o != oe; ++o) {
+        outputTypes.push_back(valueOf(*o)->getType());
+    }
+    Type *returnType = outputTypes[0];
+    if (outputs.size() > 1) {
+        returnType = StructType::get(module->getContext(), outputTypes);
+    }
+
+    Instruction *point = cast<Instruction>(valueOf(first));
+    IRBuilder<> builder(point);
+    FunctionType *type = FunctionType::get(returnType, argTypes, false);
+    CallInst *call = builder.CreateCall(getFunction(tile, type), args);
+
+    std::vector<Instruction *> olds;
+    for (size_t i = 0, e = outputs.size(); i < e; i++) {
+        Value *result = call;
+        if (outputs.size() > 1) {
+            result = builder.CreateExtractValue(call, i);
+        }
+        Instruction *old = cast<Instruction>(valueOf(outputs[i]));
+        old->replaceAllUsesWith(result);
+        replaced[values->find(outputs[i])->second] = result;
+        olds.push_back(old);
+    }
+
+    // Outputs may use each other, so they are erased after all are
+    // replaced.
+    std::vector<Instruction *>::iterator i = olds.begin(), e = olds.end();
+    for (; i != e; ++i) {
+        eraseDead(*i);
+    }
+    return true;
+}
+
+} // namespace aise
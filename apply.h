@@ -0,0 +1,71 @@
+#ifndef AISE_APPLY_H
+#define AISE_APPLY_H
+
+#include "node.h"
+#include "utils.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Function.h"
+#include <map>
+#include <set>
+
+namespace aise
+{
+
+// MISOApplier rewrites the module that DAGs are parsed from by the tiles
+// selected by MISOSelector::Select. Nodes of each applied instruction are
+// replaced with a call to a declared function, which stands for the
+// instruction until the backend knows it:
+// - The function is named by SetName, and has the RefRPN of the
+//   instruction as its "aise-refrpn" attribute.
+// - Arguments are the inputs in the order of RefRPN, then the immediates.
+// - A multi-output instruction returns a struct of its outputs.
+class MISOApplier
+{
+    llvm::Module *module;
+    const NodeValueMap *values;
+    // Outputs of applied tiles are erased, and replaced with results of
+    // the calls, which DAGs of other blocks may still refer to.
+    llvm::DenseMap<llvm::Value *, llvm::Value *> replaced;
+    llvm::StringMap<std::string> names;
+    // An instruction may be applied to values of different types, which
+    // takes a function for each.
+    std::map<std::pair<std::string, llvm::FunctionType *>, llvm::Function *>
+        functions;
+    size_t applied, skipped;
+
+    llvm::Value *valueOf(const Node *node);
+
+    llvm::Function *getFunction(const IntriNode *tile,
+                                llvm::FunctionType *type);
+
+    // apply replaces the nodes of tile with a call before its first
+    // output. Returns false if an input from blocks isn't ready there.
+    bool apply(const IntriNode *tile, const NodeArray &outputs,
+               const std::set<const llvm::BasicBlock *> &blocks);
+
+  public:
+    MISOApplier(llvm::Module *_module, const NodeValueMap *_values)
+        : module(_module), values(_values), applied(0), skipped(0) {}
+
+    // SetName names the function of instruction RefRPN (default
+    // "aise.miso"). Functions of other types are suffixed with ".1", ".2"
+    // and so on.
+    void SetName(const std::string &RefRPN, const std::string &name)
+    {
+        names[RefRPN] = name;
+    }
+
+    // Apply rewrites the tiles of DAG. DAG should be parsed with values
+    // and then selected.
+    void Apply(const NodeArray &DAG);
+
+    size_t GetApplied() { return applied; }
+    // GetSkipped returns the number of multi-output tiles that can't be
+    // applied, since an input is defined after one of the outputs.
+    size_t GetSkipped() { return skipped; }
+};
+
+} // namespace aise
+
+#endif
@@ -0,0 +1,196 @@
+import os
+import sys
+import json
+import time
+import tempfile
+import argparse
+import threading
+from subprocess import Popen, PIPE, STDOUT
+from typing import List, Dict, Any, Optional
+
+parser = argparse.ArgumentParser(description='Benchmark main over a corpus')
+parser.add_argument('-o', default='bench.json',
+                    help='Specify output file (default bench.json)')
+parser.add_argument('-b', help='Specify baseline file to compare with')
+parser.add_argument('-d', default='hotspot',
+                    help='Specify corpus directory (default hotspot)')
+parser.add_argument('-engine', default='cut',
+                    help='Specify enum engine (default cut)')
+parser.add_argument('-timeout', type=int, default=60,
+                    help='Specify timeout of each run in seconds (default 60)')
+parser.add_argument('-threshold', type=float, default=0.2,
+                    help='Specify tolerated growth of time and memory '
+                         '(default 0.2)')
+
+MAIN_PATH = './main'
+# (max-input, max-depth) of each enum run
+SETTINGS = [(2, 10), (3, 10), (4, 10), (3, 5)]
+# Runs faster than this are too noisy to compare.
+MIN_TIME = 0.2
+
+
+def run(cmd: List[str]) -> Dict[str, Any]:
+    '''Run cmd, and return its status, output, wall time and peak RSS'''
+    start = time.time()
+    p = Popen(cmd, stdout=PIPE, stderr=STDOUT, encoding='utf-8')
+    timer = threading.Timer(args.timeout, p.kill)
+    timer.start()
+    out = p.stdout.read()
+    _, status, usage = os.wait4(p.pid, 0)
+    elapsed = time.time() - start
+    timer.cancel()
+    p.returncode = os.waitstatus_to_exitcode(status)
+
+    # ru_maxrss is in bytes on macOS and in KB elsewhere
+    rss = usage.ru_maxrss
+    if sys.platform == 'darwin':
+        rss //= 1024
+
+    if elapsed >= args.timeout:
+        state = 'timeout'
+    elif p.returncode:
+        state = 'error'
+    else:
+        state = 'ok'
+    return {'status': state, 'out': out, 'time': elapsed, 'rss_kb': rss}
+
+
+def parse_value(out: str, prefix: str) -> Optional[int]:
+    for line in out.splitlines():
+        if line.startswith(prefix):
+            return int(line[len(prefix):])
+    return None
+
+
+def bench_one(bitcode: str, conf: Optional[str], max_input: int,
+              max_depth: int, miso_path: str) -> Dict[str, Any]:
+    '''Run enum, then isel and area on the instructions found'''
+    result = {}
+    cmd = [MAIN_PATH, 'enum', '-engine', args.engine, '-stats',
+           '-max-input', str(max_input), '-max-depth', str(max_depth),
+           '-o', miso_path, bitcode]
+    r = run(cmd)
+    result['enum'] = enum = {k: r[k] for k in ('status', 'time', 'rss_kb')}
+    if r['status'] != 'ok':
+        return result
+    with open(miso_path) as f:
+        enum['candidates'] = sum(1 for line in f if line.strip())
+    enum['candidates_per_s'] = enum['candidates'] / max(r['time'], 1e-6)
+    # counters of -stats, missing if compiled out
+    enum['yields'] = parse_value(r['out'], 'yields: ')
+    enum['permutations'] = parse_value(r['out'], 'permutations: ')
+    if enum['yields'] is not None:
+        enum['yields_per_s'] = enum['yields'] / max(r['time'], 1e-6)
+
+    cmd = [MAIN_PATH, 'isel', '-max-depth', str(max_depth),
+           bitcode, miso_path]
+    if conf:
+        cmd.append(conf)
+    r = run(cmd)
+    result['isel'] = isel = {k: r[k] for k in ('status', 'time', 'rss_kb')}
+    isel['sta'] = parse_value(r['out'], 'STA: ')
+
+    r = run([MAIN_PATH, 'area', miso_path])
+    result['area'] = parse_value(r['out'], 'Area: ')
+    return result
+
+
+def bench_all() -> Dict[str, Any]:
+    names = sorted(i[:-len('.bc')] for i in os.listdir(args.d)
+                   if i.endswith('.bc'))
+    fd, miso_path = tempfile.mkstemp(suffix='.miso.txt')
+    os.close(fd)
+
+    results = {}
+    print('%-24s %3s %3s %9s %9s %6s %9s %10s' %
+          ('bench', 'in', 'dep', 'enum(s)', 'rss(KB)', 'cand', 'yields',
+           'STA'))
+    try:
+        for name in names:
+            bitcode = os.path.join(args.d, name + '.bc')
+            conf = os.path.join(args.d, name + '.conf')
+            if not os.path.exists(conf):
+                conf = None
+            for max_input, max_depth in SETTINGS:
+                key = '%s/%d/%d' % (name, max_input, max_depth)
+                r = bench_one(bitcode, conf, max_input, max_depth, miso_path)
+                results[key] = r
+                enum = r['enum']
+                if enum['status'] != 'ok':
+                    print('%-24s %3d %3d %9s' %
+                          (name, max_input, max_depth, enum['status']))
+                    continue
+                print('%-24s %3d %3d %9.3f %9d %6d %9s %10s' %
+                      (name, max_input, max_depth, enum['time'],
+                       enum['rss_kb'], enum['candidates'], enum['yields'],
+                       r['isel']['sta']), flush=True)
+    finally:
+        os.remove(miso_path)
+
+    return {'engine': args.engine, 'settings': SETTINGS, 'results': results}
+
+
+def compare(results: Dict[str, Any], baseline: Dict[str, Any]) -> int:
+    '''Print differences from baseline and return number of regressions'''
+    regressions = 0
+
+    def report(key: str, message: str, regressed: bool):
+        nonlocal regressions
+        regressions += regressed
+        print('%s %s: %s' % ('REGRESSION' if regressed else 'note',
+                             key, message))
+
+    def check_run(key: str, cur: Dict[str, Any], base: Dict[str, Any]):
+        if base['status'] == 'ok' and cur['status'] != 'ok':
+            report(key, 'was ok, now %s' % cur['status'], True)
+            return
+        if base['status'] != 'ok' or cur['status'] != 'ok':
+            return
+        limit = 1 + args.threshold
+        if base['time'] >= MIN_TIME and cur['time'] > base['time'] * limit:
+            report(key, 'time %.3fs -> %.3fs' % (base['time'], cur['time']),
+                   True)
+        if cur['rss_kb'] > base['rss_kb'] * limit:
+            report(key, 'rss %dKB -> %dKB' % (base['rss_kb'], cur['rss_kb']),
+                   True)
+
+    for key, base in sorted(baseline['results'].items()):
+        cur = results['results'].get(key)
+        if cur is None:
+            report(key, 'missing', True)
+            continue
+
+        check_run(key + ' enum', cur['enum'], base['enum'])
+        if 'isel' not in base or 'isel' not in cur:
+            continue
+        check_run(key + ' isel', cur['isel'], base['isel'])
+
+        # The same engine should always find the same instructions.
+        if cur['enum']['candidates'] != base['enum']['candidates']:
+            report(key, 'candidates %d -> %d' %
+                   (base['enum']['candidates'], cur['enum']['candidates']),
+                   results['engine'] == baseline['engine'])
+        if cur['isel']['sta'] != base['isel']['sta']:
+            report(key, 'STA %s -> %s' %
+                   (base['isel']['sta'], cur['isel']['sta']),
+                   (cur['isel']['sta'] or 0) > (base['isel']['sta'] or 0))
+        if cur['area'] != base['area']:
+            report(key, 'area %s -> %s' % (base['area'], cur['area']), False)
+
+    return regressions
+
+
+if __name__ == '__main__':
+    args = parser.parse_args()
+
+    results = bench_all()
+    with open(args.o, 'w') as f:
+        json.dump(results, f, indent=1, sort_keys=True)
+
+    if args.b:
+        with open(args.b) as f:
+            baseline = json.load(f)
+        regressions = compare(results, baseline)
+        print('%d regression(s) against %s' % (regressions, args.b))
+        if regressions:
+            sys.exit(1)
@@ -0,0 +1,309 @@
+#include "eval.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <cstdlib>
+
+using namespace aise;
+using namespace llvm;
+
+namespace
+{
+
+int64_t divide(int64_t a, int64_t b)
+{
+    if (b == 0) {
+        return 0;
+    }
+    if (b == -1) {
+        return (int64_t)(0 - (uint64_t)a);
+    }
+    return a / b;
+}
+
+int64_t remainder(int64_t a, int64_t b)
+{
+    if (b == 0 || b == -1) {
+        return 0;
+    }
+    return a % b;
+}
+
+// evalOp computes an op from its operands in order. Inverses of products
+// take the value of their operand, see MISOEvaluator.
+int64_t evalOp(Node::NodeType type, const std::vector<int64_t> &ops)
+{
+    uint64_t acc;
+    unsigned shift = ops.size() > 1 ? ops[1] & 63 : 0;
+
+    switch (type) {
+    case Node::AddTy:
+        acc = 0;
+        for (size_t i = 0; i < ops.size(); i++) {
+            acc += ops[i];
+        }
+        return acc;
+    case Node::MulTy:
+        acc = 1;
+        for (size_t i = 0; i < ops.size(); i++) {
+            acc *= ops[i];
+        }
+        return acc;
+    case Node::AndTy:
+        acc = -1;
+        for (size_t i = 0; i < ops.size(); i++) {
+            acc &= ops[i];
+        }
+        return acc;
+    case Node::OrTy:
+        acc = 0;
+        for (size_t i = 0; i < ops.size(); i++) {
+            acc |= ops[i];
+        }
+        return acc;
+    case Node::XorTy:
+        acc = 0;
+        for (size_t i = 0; i < ops.size(); i++) {
+            acc ^= ops[i];
+        }
+        return acc;
+
+    case Node::AddInvTy:
+        return (int64_t)(0 - (uint64_t)ops[0]);
+    case Node::MulInvTy:
+        return ops[0];
+
+    case Node::SubTy:
+        return (int64_t)((uint64_t)ops[0] - (uint64_t)ops[1]);
+    case Node::DivTy:
+        return divide(ops[0], ops[1]);
+    case Node::RemTy:
+        return remainder(ops[0], ops[1]);
+
+    case Node::ShlTy:
+        return (int64_t)((uint64_t)ops[0] << shift);
+    case Node::LshrTy:
+        return (int64_t)((uint64_t)ops[0] >> shift);
+    case Node::AshrTy:
+        return ops[0] < 0 ? ~(~ops[0] >> shift) : ops[0] >> shift;
+
+    case Node::EqTy:
+        return ops[0] == ops[1];
+    case Node::NeTy:
+        return ops[0] != ops[1];
+    case Node::GtTy:
+        return ops[0] > ops[1];
+    case Node::GeTy:
+        return ops[0] >= ops[1];
+    case Node::LtTy:
+        return ops[0] < ops[1];
+    case Node::LeTy:
+        return ops[0] <= ops[1];
+
+    case Node::SelectTy:
+        return ops[0] ? ops[1] : ops[2];
+
+    default:
+        return 0;
+    }
+}
+
+// evalNode computes node from values of nodes, which are indexed by
+// Index. Products divide by their inverted operands.
+int64_t evalNode(const Node *node, const std::vector<int64_t> &values)
+{
+    std::vector<int64_t> ops;
+    std::vector<int64_t> divisors;
+    Node::const_node_iterator p = node->PredBegin(), pe = node->PredEnd();
+    for (; p != pe; ++p) {
+        if (node->TypeOf(Node::MulTy) && (*p)->TypeOf(Node::MulInvTy)) {
+            divisors.push_back(values[(*p)->Index]);
+        } else {
+            ops.push_back(values[(*p)->Index]);
+        }
+    }
+
+    int64_t value = evalOp(node->Type, ops);
+    for (size_t i = 0; i < divisors.size(); i++) {
+        value = divide(value, divisors[i]);
+    }
+    return value;
+}
+
+// valueOfConst returns the value of a constant. Undefined values are 0.
+int64_t valueOfConst(const Node *node)
+{
+    return std::strtoll(ConstNode::ValueOf(node).c_str(), NULL, 10);
+}
+
+} // namespace
+
+namespace aise
+{
+
+uint64_t MISOEvaluator::random()
+{
+    // xorshift64*
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    uint64_t value = state * 2685821657736338717ULL;
+
+    // Small values are more likely to hit corner cases of comparisons and
+    // shifts, so half of the inputs are in [-8, 8].
+    if (value & 1) {
+        return (int64_t)((value >> 1) % 17) - 8;
+    }
+    return value >> 1;
+}
+
+void MISOEvaluator::AddInstr(const std::string &RefRPN, const NodeArray *DAG)
+{
+    for (size_t i = 0, e = DAG->size(); i < e; i++) {
+        DAG->at(i)->Index = i;
+    }
+    instrs[RefRPN] = DAG;
+}
+
+void MISOEvaluator::evalInstr(const NodeArray &DAG,
+                              const std::vector<int64_t> &inputs,
+                              const std::vector<int64_t> &immediates,
+                              std::vector<int64_t> &outputs)
+{
+    std::vector<int64_t> values(DAG.size());
+    size_t immediate = 0;
+    for (size_t i = 0, e = DAG.size(); i < e; i++) {
+        const Node *node = DAG[i];
+        if (node->IsInput()) {
+            values[i] = inputs.at(node->Type - Node::FirstInputTy);
+        } else if (ConstNode::IsImmediate(node)) {
+            values[i] = immediates.at(immediate++);
+        } else if (node->IsConstant()) {
+            values[i] = valueOfConst(node);
+        } else if (node->TypeOf(Node::UnkTy)) {
+            // virtual successor of an output
+            outputs.push_back(values[(*node->PredBegin())->Index]);
+        } else {
+            values[i] = evalNode(node, values);
+        }
+    }
+    if (outputs.empty()) {
+        outputs.push_back(values.back());
+    }
+}
+
+int64_t MISOEvaluator::evalTiled(size_t index, context &ctx)
+{
+    if (ctx.Done[index]) {
+        return ctx.Tiled[index];
+    }
+
+    const Node *node = ctx.DAG->at(index);
+    const IntriNode *tile = node->TileList.front();
+    std::vector<int64_t> inputs;
+    bool inputsAgree = true;
+    Node::const_node_iterator p = tile->PredBegin(), pe = tile->PredEnd();
+    for (; p != pe; ++p) {
+        size_t pred = (*p)->Index;
+        inputs.push_back(evalTiled(pred, ctx));
+        inputsAgree = inputsAgree && inputs.back() == ctx.Original[pred];
+    }
+
+    // A default tile is the node itself.
+    if (tile->RefRPN.empty()) {
+        ctx.Done[index] = true;
+        if (node->IsOp()) {
+            ctx.Tiled[index] = evalNode(node, ctx.Tiled);
+        } else {
+            ctx.Tiled[index] = ctx.Original[index];
+        }
+        if (ctx.CountCycles) {
+            cycles += tile->Cost * ctx.WeightOf(index);
+        }
+        return ctx.Tiled[index];
+    }
+
+    std::vector<int64_t> immediates, outputs;
+    NodeArray::const_iterator m = tile->Immediates.begin();
+    for (; m != tile->Immediates.end(); ++m) {
+        immediates.push_back(ctx.Original[(*m)->Index]);
+    }
+    evalInstr(*instrs.find(tile->RefRPN)->second, inputs, immediates,
+              outputs);
+
+    // A multi-output tile gives all of its outputs at once. The applier
+    // calls it before its first output, so it's executed as often as that
+    // one.
+    NodeArray single(1, const_cast<Node *>(node));
+    const NodeArray &outputNodes = tile->Outputs.empty() ? single
+                                                         : tile->Outputs;
+    size_t first = index;
+    bool outputsAgree = true;
+    for (size_t i = 0, e = outputNodes.size(); i < e; i++) {
+        size_t output = outputNodes[i]->Index;
+        ctx.Done[output] = true;
+        ctx.Tiled[output] = outputs.at(i);
+        outputsAgree = outputsAgree && outputs[i] == ctx.Original[output];
+        first = std::min(first, output);
+    }
+    if (ctx.CountCycles) {
+        cycles += tile->Cost * ctx.WeightOf(first);
+        checked++;
+    }
+
+    // The tile is wrong only if it's given the right inputs.
+    if (inputsAgree && !outputsAgree &&
+        mismatched.insert(tile->RefRPN).second) {
+        errs() << "Mismatch: " << tile->RefRPN << ":";
+        for (size_t i = 0, e = outputNodes.size(); i < e; i++) {
+            errs() << " expected " << ctx.Original[outputNodes[i]->Index]
+                   << ", got " << outputs[i];
+        }
+        errs() << '\n';
+    }
+    return ctx.Tiled[index];
+}
+
+size_t MISOEvaluator::Evaluate(const NodeArray &DAG,
+                               const std::vector<size_t> *weights)
+{
+    size_t before = mismatched.size();
+    size_t size = DAG.size();
+    context ctx;
+    ctx.DAG = &DAG;
+    ctx.Weights = weights;
+    ctx.Original.resize(size);
+    ctx.Tiled.resize(size);
+
+    for (size_t sample = 0; sample < samples; sample++) {
+        ctx.CountCycles = sample == 0;
+
+        // original ops in topological order
+        for (size_t i = 0; i < size; i++) {
+            const Node *node = DAG[i];
+            if (node->IsConstant()) {
+                ctx.Original[i] = valueOfConst(node);
+            } else if (node->IsOp()) {
+                ctx.Original[i] = evalNode(node, ctx.Original);
+                if (ctx.CountCycles) {
+                    baseCycles += Node::RoundUpUnitCost(
+                                      Node::TypeCost(node->Type)) *
+                                  ctx.WeightOf(i);
+                }
+            } else {
+                ctx.Original[i] = random();
+            }
+        }
+
+        // Only nodes needed by the sinks are executed, as topDown does.
+        ctx.Done.assign(size, false);
+        for (size_t i = 0; i < size; i++) {
+            if (DAG[i]->Succ.empty() && !DAG[i]->TileList.empty()) {
+                evalTiled(i, ctx);
+            }
+        }
+    }
+
+    return mismatched.size() - before;
+}
+
+} // namespace aise
@@ -0,0 +1,92 @@
+#ifndef AISE_EVAL_H
+#define AISE_EVAL_H
+
+#include "node.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Support/DataTypes.h"
+#include <set>
+#include <vector>
+
+namespace aise
+{
+
+// MISOEvaluator executes DAGs tiled by MISOSelector::Select on random
+// inputs, to check that the tiles compute what the original ops do and
+// that STA counts the tiles that are executed.
+// - Values are 64-bit integers with wrapping arithmetic, and comparisons
+//   are signed. Division or remainder by 0 gives 0.
+// - Ops that aren't modeled, like loads, are inputs of the DAG.
+// - A product with inverses multiplies the other operands first, then
+//   divides by the inverted ones in order.
+class MISOEvaluator
+{
+    // instructions by RefRPN, parsed by ParseMISO
+    llvm::StringMap<const NodeArray *> instrs;
+    size_t samples;
+    uint64_t state;
+    size_t cycles, baseCycles, checked;
+    // tiles found wrong in any DAG, by RefRPN
+    std::set<std::string> mismatched;
+
+    class context
+    {
+      public:
+        const NodeArray *DAG;
+        const std::vector<size_t> *Weights;
+
+        size_t WeightOf(size_t index) const
+        {
+            return Weights ? Weights->at(index) : 1;
+        }
+
+        // values of nodes by the original ops and by the tiles, in the
+        // same order of nodes in DAG
+        std::vector<int64_t> Original, Tiled;
+        std::vector<bool> Done;
+        // Cycles is only counted once, since the same tiles are executed
+        // for every sample.
+        bool CountCycles;
+    };
+
+    uint64_t random();
+
+    // evalInstr runs instruction DAG on inputs and immediates, and
+    // returns the values of its outputs in order.
+    void evalInstr(const NodeArray &DAG, const std::vector<int64_t> &inputs,
+                   const std::vector<int64_t> &immediates,
+                   std::vector<int64_t> &outputs);
+
+    // evalTiled returns the value of node by its tile, executing the tiles
+    // of its operands first.
+    int64_t evalTiled(size_t index, context &ctx);
+
+  public:
+    MISOEvaluator(size_t _samples, uint64_t seed)
+        : samples(_samples), state(seed), cycles(0), baseCycles(0),
+          checked(0) {}
+
+    // AddInstr adds the DAG of instruction RefRPN, which is kept until the
+    // evaluator is destructed.
+    // Note: DAG should be legalized. Indexes of nodes are changed.
+    void AddInstr(const std::string &RefRPN, const NodeArray *DAG);
+
+    // Evaluate checks a DAG selected by MISOSelector::Select. Weights are
+    // the same as for Select.
+    // Returns the number of tiles that give wrong results, which are also
+    // reported to errs().
+    size_t Evaluate(const NodeArray &DAG,
+                    const std::vector<size_t> *weights = NULL);
+
+    // GetCycles returns the cycles of the tiles executed, weighted by
+    // the weights of their nodes.
+    size_t GetCycles() { return cycles; }
+    // GetBaseCycles returns the cycles of the original ops.
+    size_t GetBaseCycles() { return baseCycles; }
+    // GetChecked returns the number of custom tiles executed.
+    size_t GetChecked() { return checked; }
+    size_t GetMismatched() { return mismatched.size(); }
+};
+
+} // namespace aise
+
+#endif
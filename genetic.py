@@ -15,6 +15,10 @@ parser.add_argument('miso', help='Specify MISO file')
 parser.add_argument('bcconf', nargs='?', help='Specify conf file for bitcode')
 parser.add_argument('-i', type=int, help='Specify number of iterations')
 parser.add_argument('-p', type=int, help='Specify population size')
+parser.add_argument('-imm-width', type=int, default=0,
+                    help='Specify width of immediates used by enum')
+parser.add_argument('-greedy',
+                    help='Specify trajectory printed by greedy to seed skyline')
 
 GA_PARAMS = {
     'max_num_iteration': None,
@@ -48,7 +52,8 @@ def get_area(miso_path: str) -> int:
 
 
 def get_sta(miso_path: str) -> int:
-    cmd = [MAIN_PATH, 'isel', args.bitcode, miso_path]
+    cmd = [MAIN_PATH, 'isel', '-imm-width', str(args.imm_width),
+           args.bitcode, miso_path]
     if args.bcconf:
         cmd.append(args.bcconf)
     p = Popen(cmd, stdout=PIPE, encoding='utf-8')
@@ -59,6 +64,17 @@ def get_sta(miso_path: str) -> int:
     return int(result[len('STA: '):])
 
 
+def read_greedy(path: str) -> List[Tuple[int, int]]:
+    '''Read (area, STA) of each step of greedy'''
+    with open(path) as f:
+        lines = f.readlines()[1:]
+    points = []
+    for line in lines:
+        area, sta, _ = line.split('\t')
+        points.append((int(area), int(sta)))
+    return points
+
+
 def run_isel(x: np.array) -> Tuple[float, float]:
     inputs = (1 << x.shape[0]) - 1
     instr_num = 0
@@ -162,6 +178,11 @@ if __name__ == '__main__':
     STA_BASE = get_sta('/dev/null')
     db_gene = DB()
     db_rand = DB()
+    # geneticalgorithm has no initial population, so the greedy trajectory
+    # only starts the skyline of GA
+    if args.greedy:
+        for area, sta in read_greedy(args.greedy):
+            db_gene.add_point(-area / AREA_ALL, -sta / STA_BASE)
 
     model = ga(function=do_gene_and_rand,
                dimension=len(misos),
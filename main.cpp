@@ -1,7 +1,18 @@
 #include "node.h"
 #include "utils.h"
 #include "miso.h"
+#include "apply.h"
+#include "eval.h"
+#include "stats.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Bitcode/ReaderWriter.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Format.h"
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <queue>
+#include <sys/stat.h>
 
 using namespace aise;
 using namespace llvm;
@@ -13,16 +24,64 @@ cl::list<std::string> inputList(cl::Positional, cl::desc("[<input>...]"));
 cl::opt<std::string> outputPath("o", cl::desc("Specify output file (default stdout)"), cl::value_desc("filename"));
 cl::opt<std::string> maxInput("max-input", cl::desc("Specify max input (default 2)"), cl::value_desc("int"), cl::init("2"));
 cl::opt<std::string> maxDepth("max-depth", cl::desc("Specify max depth (default 10)"), cl::value_desc("int"), cl::init("10"));
+cl::opt<std::string> maxOutput("max-output", cl::desc("Specify max output (default 1)"), cl::value_desc("int"), cl::init("1"));
+cl::opt<std::string> immWidth("imm-width", cl::desc("Specify width of immediates that constants are generalized to (default 0, off)"), cl::value_desc("bits"), cl::init("0"));
+cl::opt<std::string> window("window", cl::desc("Specify max number of nodes in the upper cone of each root of enum (default 0, unbounded)"), cl::value_desc("int"), cl::init("0"));
+cl::opt<std::string> jobs("jobs", cl::desc("Specify number of threads canonicalizing cuts of enum (default 1, in line)"), cl::value_desc("int"), cl::init("1"));
+cl::opt<std::string> engine("engine", cl::desc("Specify enum engine: atasu, cut (default atasu)"), cl::value_desc("name"), cl::init("atasu"));
+cl::opt<std::string> areaModel("area-model", cl::desc("Specify area model: sum, share (default share)"), cl::value_desc("name"), cl::init("share"));
+cl::opt<std::string> samples("samples", cl::desc("Specify number of random inputs of eval (default 16)"), cl::value_desc("int"), cl::init("16"));
+cl::opt<std::string> seed("seed", cl::desc("Specify random seed of eval (default 1)"), cl::value_desc("int"), cl::init("1"));
+cl::opt<std::string> points("points", cl::desc("Specify number of area budgets of sweep (default 10)"), cl::value_desc("int"), cl::init("10"));
+cl::opt<std::string> objective("objective", cl::desc("Specify objective of share: sum, min (default sum)"), cl::value_desc("name"), cl::init("sum"));
+cl::opt<std::string> budget("budget", cl::desc("Specify area budget of share (default 0, unlimited)"), cl::value_desc("int"), cl::init("0"));
+cl::opt<std::string> cacheDir("cache", cl::desc("Specify directory where enum caches the instructions of each block"), cl::value_desc("dirname"));
+cl::opt<std::string> mapPath("map", cl::desc("Specify output file of the lines prune keeps, as <input line> <output line>"), cl::value_desc("filename"));
+cl::opt<std::string> libraryPath("library", cl::desc("Specify output file of the library merged by share"), cl::value_desc("filename"));
+cl::opt<bool> enumTiles("enum-tiles", cl::desc("Find tiles by enumerating all cuts instead of matching instructions directly"));
+cl::opt<bool> trace("trace", cl::desc("Group basic blocks into hot traces by <bcconf>"));
 cl::opt<bool> interactive("interactive", cl::desc("Use interactive mode"));
 cl::extrahelp commandHelp(
     "\nCOMMAND:\n"
     "  enum - Enumerate MISO instructions in LLVM assembly\n"
     "         input: <bitcode>\n"
+    "         inputs (-trace): <bitcode> [<bcconf>]\n"
     "  isel - Apply MISO instructions to LLVM assembly\n"
     "         inputs (one-off): <bitcode> <miso> [<bcconf>]\n"
+    "         Use -trace to select over hot traces instead of blocks\n"
     "         inputs (interactive): <bitcode> [<bcconf>]\n"
+    "  apply - Replace selected MISO instructions in LLVM assembly with\n"
+    "          calls, and write the bitcode\n"
+    "          inputs: <bitcode> <miso> [<bcconf>]\n"
+    "          Use -trace to select over hot traces instead of blocks\n"
+    "  eval - Check selected MISO instructions against the original ops on\n"
+    "         random inputs, and count the cycles executed\n"
+    "         inputs: <bitcode> <miso> [<bcconf>]\n"
+    "         Use -samples and -seed to change the inputs\n"
+    "  prune - Remove MISO instructions that can never be selected\n"
+    "          inputs: <bitcode> <miso> [<bcconf>]\n"
+    "          Use -trace to profile over hot traces instead of blocks, and\n"
+    "          -map to write the new line of each line kept\n"
+    "  sweep - Select subsets of MISO instructions with the least STA for\n"
+    "          area budgets, by Lagrangian relaxation\n"
+    "          inputs: <bitcode> <miso> [<bcconf>]\n"
+    "          Use -points to change the number of budgets, and -o to\n"
+    "          write each subset to <filename>.<budget>.txt\n"
+    "  greedy - Add MISO instructions one by one, each saving the most STA\n"
+    "           per area, and print the trajectory\n"
+    "           inputs: <bitcode> <miso> [<bcconf>]\n"
+    "           Use -o to write the instructions in the order added\n"
+    "  share - Select MISO instructions for several applications at once\n"
+    "          inputs: <manifest> <miso>...\n"
+    "          Each line of <manifest> is <weight> <bitcode> [<bcconf>]\n"
+    "          Use -objective min to raise the worst speedup instead of\n"
+    "          the weighted mean, -budget to limit the area, -library to\n"
+    "          write the merged library, and -o to write the instructions\n"
+    "          in the order added\n"
     "  area - Count area of MISO instructions\n"
-    "         input: <miso>\n");
+    "         input: <miso>\n"
+    "         Use -area-model sum to count each instruction separately\n"
+    "\nUse -stats to print counters and timers of each phase to stderr.\n");
 
 int parseNonNeg(const std::string &str, const char *name)
 {
@@ -39,27 +98,116 @@ int parseNonNeg(const std::string &str, const char *name)
     return value;
 }
 
-int doEnum()
+// parseImmWidth parses -imm-width. Returns -1 if there is any error.
+int parseImmWidth()
 {
-    if (inputList.size() != 1) {
-        errs() << "enum: Requires exactly 1 input\n";
+    int value = parseNonNeg(immWidth, "-imm-width");
+    if (value > 64) {
+        errs() << "Invalid value '" << value
+               << "' for '-imm-width': Should be at most 64\n";
         return -1;
     }
+    return value;
+}
 
-    std::list<NodeArray *> buffer;
-    if (ParseBitcode(inputList[0], buffer) < 0) {
+// parseAreaModel parses -area-model. Returns -1 if there is any error.
+int parseAreaModel(const char *cmd, MISOSynthesizer::Model &model)
+{
+    if (areaModel == "sum") {
+        model = MISOSynthesizer::SumModel;
+    } else if (areaModel == "share") {
+        model = MISOSynthesizer::ShareModel;
+    } else {
+        errs() << cmd << ": Unknown area model: " << areaModel << '\n';
         return -1;
     }
+    return 0;
+}
+
+int doEnum()
+{
+    std::list<NodeArray *> buffer;
+    if (trace) {
+        if (inputList.size() < 1 || inputList.size() > 2) {
+            errs() << "enum (-trace): Requires 1 or 2 inputs\n";
+            return -1;
+        }
+        std::list<size_t> confBuffer;
+        std::list<std::vector<size_t> > weights;
+        if (inputList.size() == 2 && ParseConf(inputList[1], confBuffer) < 0) {
+            return -1;
+        }
+        if (ParseTraces(inputList[0], confBuffer, buffer, weights) < 0) {
+            return -1;
+        }
+    } else {
+        if (inputList.size() != 1) {
+            errs() << "enum: Requires exactly 1 input\n";
+            return -1;
+        }
+        if (ParseBitcode(inputList[0], buffer) < 0) {
+            return -1;
+        }
+    }
 
-    int maxInputVal, maxDepthVal;
+    int maxInputVal, maxDepthVal, maxOutputVal;
     if ((maxInputVal = parseNonNeg(maxInput, "-max-input")) < 0) {
         return -1;
     }
     if ((maxDepthVal = parseNonNeg(maxDepth, "-max-depth")) < 0) {
         return -1;
     }
+    if ((maxOutputVal = parseNonNeg(maxOutput, "-max-output")) < 0) {
+        return -1;
+    }
+    int immWidthVal;
+    if ((immWidthVal = parseImmWidth()) < 0) {
+        return -1;
+    }
+    if (maxOutputVal < 1) {
+        errs() << "enum: -max-output should be at least 1\n";
+        return -1;
+    }
+    int windowVal, jobsVal;
+    if ((windowVal = parseNonNeg(window, "-window")) < 0) {
+        return -1;
+    }
+    if ((jobsVal = parseNonNeg(jobs, "-jobs")) < 0) {
+        return -1;
+    }
+    if (jobsVal < 1) {
+        errs() << "enum: -jobs should be at least 1\n";
+        return -1;
+    }
+
+    MISOEnumerator::Engine engineVal;
+    if (engine == "atasu") {
+        engineVal = MISOEnumerator::AtasuEngine;
+    } else if (engine == "cut") {
+        engineVal = MISOEnumerator::CutEngine;
+    } else {
+        errs() << "enum: Unknown engine: " << engine << '\n';
+        return -1;
+    }
 
-    MISOEnumerator misoEnum(maxInputVal, maxDepthVal);
+    if (maxOutputVal > 1 && engineVal != MISOEnumerator::CutEngine) {
+        errs() << "enum: -max-output above 1 requires -engine cut\n";
+        return -1;
+    }
+
+    MISOEnumerator misoEnum(maxInputVal, maxDepthVal, engineVal,
+                            maxOutputVal);
+    misoEnum.SetImmediateWidth(immWidthVal);
+    misoEnum.SetWindow(windowVal);
+    misoEnum.SetJobs(jobsVal);
+    if (!cacheDir.empty()) {
+        if (mkdir(cacheDir.c_str(), 0777) < 0 && errno != EEXIST) {
+            errs() << "enum: " << cacheDir << ": " << std::strerror(errno)
+                   << '\n';
+            return -1;
+        }
+        misoEnum.SetCache(cacheDir);
+    }
     std::list<NodeArray *>::iterator i, e;
     for (i = buffer.begin(), e = buffer.end(); i != e; ++i) {
         misoEnum.Enumerate(*i);
@@ -77,50 +225,924 @@ int doEnum()
     return 0;
 }
 
-int doIsel()
+// parseWorkload parses a bitcode and its optional conf, with the same
+// weights as isel. Returns -1 if there is any error.
+int parseWorkload(const std::string &bcPath, const std::string &confPath,
+                  std::list<NodeArray *> &bcBuffer,
+                  std::list<size_t> &confBuffer,
+                  std::list<std::vector<size_t> > &weights,
+                  Module **module = NULL, NodeValueMap *values = NULL)
+{
+    if (!confPath.empty() && ParseConf(confPath, confBuffer) < 0) {
+        return -1;
+    }
+
+    if (trace) {
+        // weights of blocks are kept in each node
+        if (ParseTraces(bcPath, confBuffer, bcBuffer, weights, module,
+                        values) < 0) {
+            return -1;
+        }
+    } else {
+        if (ParseBitcode(bcPath, bcBuffer, module, values) < 0) {
+            return -1;
+        }
+        if (confPath.empty()) {
+            confBuffer.resize(bcBuffer.size(), 1);
+        } else if (bcBuffer.size() != confBuffer.size()) {
+            errs() << "Basic blocks and configurations don't match: "
+                   << bcBuffer.size() << " and " << confBuffer.size() << '\n';
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// parseSelectInputs parses inputs of isel, prune and apply: <bitcode>
+// <miso> [<bcconf>]. Without -trace, confBuffer is parallel to bcBuffer.
+// module and values are passed to ParseBitcode or ParseTraces.
+// Returns -1 if there is any error, 0 otherwise.
+int parseSelectInputs(const char *name, std::list<NodeArray *> &misoBuffer,
+                      std::list<NodeArray *> &bcBuffer,
+                      std::list<size_t> &confBuffer,
+                      std::list<std::vector<size_t> > &weights,
+                      Module **module = NULL, NodeValueMap *values = NULL)
 {
     if (inputList.size() < 2 || inputList.size() > 3) {
-        errs() << "isel (one-off): Requires 2 or 3 inputs\n";
+        errs() << name << ": Requires 2 or 3 inputs\n";
         return -1;
     }
 
+    if (ParseMISO(inputList[1], misoBuffer) < 0) {
+        return -1;
+    }
+    return parseWorkload(inputList[0],
+                         inputList.size() == 3 ? inputList[2] : "", bcBuffer,
+                         confBuffer, weights, module, values);
+}
+
+// prepareBlocks prepares each DAG for MISOSelector::Solve, weighted as isel
+// does. Weights of blocks are kept in blockWeights.
+void prepareBlocks(MISOSelector &misoSel, std::list<NodeArray *> &bcBuffer,
+                   std::list<size_t> &confBuffer,
+                   std::list<std::vector<size_t> > &weights,
+                   std::list<std::vector<size_t> > &blockWeights)
+{
+    std::list<size_t>::iterator c = confBuffer.begin();
+    std::list<std::vector<size_t> >::iterator w = weights.begin();
+    std::list<NodeArray *>::iterator i, e;
+    for (i = bcBuffer.begin(), e = bcBuffer.end(); i != e; ++i) {
+        if (trace) {
+            misoSel.Prepare(*i, &*w++);
+        } else {
+            // the count of the block weighs every node in it
+            blockWeights.push_back(std::vector<size_t>((*i)->size(), *c++));
+            misoSel.Prepare(*i, &blockWeights.back());
+        }
+    }
+}
+
+int doIsel()
+{
     std::list<NodeArray *> bcBuffer, misoBuffer;
     std::list<size_t> confBuffer;
+    std::list<std::vector<size_t> > weights;
+    if (parseSelectInputs("isel (one-off)", misoBuffer, bcBuffer, confBuffer,
+                          weights) < 0) {
+        return -1;
+    }
 
-    if (ParseBitcode(inputList[0], bcBuffer) < 0) {
+    int maxDepthVal, immWidthVal;
+    if ((maxDepthVal = parseNonNeg(maxDepth, "-max-depth")) < 0) {
         return -1;
     }
-    if (ParseMISO(inputList[1], misoBuffer) < 0) {
+    if ((immWidthVal = parseImmWidth()) < 0) {
+        return -1;
+    }
+
+    MISOSelector misoSel(maxDepthVal);
+    misoSel.SetImmediateWidth(immWidthVal);
+    misoSel.SetEnumerate(enumTiles);
+    std::list<NodeArray *>::iterator i, e;
+    for (i = misoBuffer.begin(), e = misoBuffer.end(); i != e; ++i) {
+        misoSel.AddInstr(*i);
+    }
+
+    size_t totalSTA = 0;
+    std::list<size_t>::iterator c = confBuffer.begin();
+    std::list<std::vector<size_t> >::iterator w = weights.begin();
+    for (i = bcBuffer.begin(), e = bcBuffer.end(); i != e; ++i) {
+        if (trace) {
+            totalSTA += misoSel.Select(*i, &*w++);
+        } else {
+            size_t STA = misoSel.Select(*i);
+            totalSTA += STA * (*c++);
+        }
+    }
+
+    outs() << "STA: " << totalSTA << '\n';
+
+    return 0;
+}
+
+int doPrune()
+{
+    std::list<NodeArray *> bcBuffer, misoBuffer;
+    std::list<size_t> confBuffer;
+    std::list<std::vector<size_t> > weights;
+    if (parseSelectInputs("prune", misoBuffer, bcBuffer, confBuffer,
+                          weights) < 0) {
+        return -1;
+    }
+
+    int maxDepthVal, immWidthVal;
+    if ((maxDepthVal = parseNonNeg(maxDepth, "-max-depth")) < 0) {
         return -1;
     }
-    if (inputList.size() == 3) {
-        if (ParseConf(inputList[2], confBuffer) < 0) {
+    if ((immWidthVal = parseImmWidth()) < 0) {
+        return -1;
+    }
+
+    // Lines of the miso file are numbered from 0, skipping empty lines, as
+    // genetic.py does. Areas are counted for each instruction alone.
+    MISOSelector misoSel(maxDepthVal);
+    misoSel.SetImmediateWidth(immWidthVal);
+    misoSel.SetEnumerate(enumTiles);
+    std::vector<size_t> ids, areas;
+    std::list<NodeArray *>::iterator i, e;
+    for (i = misoBuffer.begin(), e = misoBuffer.end(); i != e; ++i) {
+        size_t id = misoSel.AddInstr(*i);
+        ids.push_back(id);
+        if (id == areas.size()) {
+            MISOSynthesizer misoSyn(MISOSynthesizer::SumModel);
+            misoSyn.AddInstr(*i);
+            areas.push_back(misoSyn.GetArea());
+        }
+    }
+
+    std::list<size_t>::iterator c = confBuffer.begin();
+    std::list<std::vector<size_t> >::iterator w = weights.begin();
+    for (i = bcBuffer.begin(), e = bcBuffer.end(); i != e; ++i) {
+        if (trace) {
+            misoSel.Profile(*i, &*w++);
+        } else {
+            // the count of the block weighs every node in it
+            std::vector<size_t> blockWeights((*i)->size(), *c++);
+            misoSel.Profile(*i, &blockWeights);
+        }
+    }
+
+    std::vector<size_t> result;
+    misoSel.Prune(areas, result);
+
+    // first line of each instruction
+    std::vector<size_t> lineOf(areas.size(), -1);
+    for (size_t line = ids.size(); line-- > 0;) {
+        lineOf[ids[line]] = line;
+    }
+
+    // Each line is reported as <line> <coverage> <gain> <verdict> <RefRPN>,
+    // where coverage is the weighted count of sites with gain. Kept lines
+    // are renumbered in the output, so each is mapped to its new line.
+    std::string pruned, map;
+    size_t kept = 0;
+    for (size_t line = 0; line < ids.size(); line++) {
+        size_t id = ids[line], coverage = 0, gain = 0;
+        const std::vector<MISOSelector::Site> &sites = misoSel.GetSites(id);
+        std::vector<MISOSelector::Site>::const_iterator s, se;
+        for (s = sites.begin(), se = sites.end(); s != se; ++s) {
+            if (s->Gain > 0) {
+                coverage += s->Weight;
+                gain += s->Gain;
+            }
+        }
+        const std::string &RefRPN = misoSel.GetRefRPN(id);
+
+        errs() << line << '\t' << coverage << '\t' << gain << '\t';
+        if (lineOf[id] != line) {
+            errs() << "duplicate of " << lineOf[id];
+        } else if (result[id] == id) {
+            errs() << "keep";
+            pruned += RefRPN;
+            pruned += '\n';
+            AppendInt(map, line);
+            map += ' ';
+            AppendInt(map, kept);
+            map += '\n';
+            kept++;
+        } else if (result[id] == (size_t)-1) {
+            errs() << "dead";
+        } else {
+            errs() << "dominated by " << lineOf[result[id]];
+        }
+        errs() << '\t' << RefRPN << '\n';
+    }
+    errs() << "Kept: " << kept << " of " << ids.size() << '\n';
+
+    if (outputPath.empty()) {
+        outs() << pruned;
+    } else {
+        OutFile out(outputPath.c_str());
+        if (!out.IsOpen()) {
             return -1;
         }
-        if (bcBuffer.size() != confBuffer.size()) {
-            errs() << "Basic blocks and configurations don't match: "
-                   << bcBuffer.size() << " and " << confBuffer.size() << '\n';
+        out.OS() << pruned;
+    }
+    if (!mapPath.empty()) {
+        OutFile out(mapPath.c_str());
+        if (!out.IsOpen()) {
             return -1;
         }
-    } else {
-        confBuffer.resize(bcBuffer.size(), 1);
+        out.OS() << map;
+    }
+    return 0;
+}
+
+int doApply()
+{
+    std::list<NodeArray *> bcBuffer, misoBuffer;
+    std::list<size_t> confBuffer;
+    std::list<std::vector<size_t> > weights;
+    Module *module;
+    NodeValueMap values;
+    if (parseSelectInputs("apply", misoBuffer, bcBuffer, confBuffer, weights,
+                          &module, &values) < 0) {
+        return -1;
+    }
+
+    int maxDepthVal, immWidthVal;
+    if ((maxDepthVal = parseNonNeg(maxDepth, "-max-depth")) < 0) {
+        return -1;
+    }
+    if ((immWidthVal = parseImmWidth()) < 0) {
+        return -1;
+    }
+
+    // Functions are named by the first line of each instruction, counting
+    // from 0 as prune does.
+    MISOSelector misoSel(maxDepthVal);
+    misoSel.SetImmediateWidth(immWidthVal);
+    misoSel.SetEnumerate(enumTiles);
+    MISOApplier misoApp(module, &values);
+    std::list<NodeArray *>::iterator i, e;
+    size_t line = 0, named = 0;
+    for (i = misoBuffer.begin(), e = misoBuffer.end(); i != e; ++i, ++line) {
+        size_t id = misoSel.AddInstr(*i);
+        if (id == named) {
+            misoApp.SetName(misoSel.GetRefRPN(id), "aise." + ToString(line));
+            named++;
+        }
+    }
+
+    size_t totalSTA = 0;
+    std::list<size_t>::iterator c = confBuffer.begin();
+    std::list<std::vector<size_t> >::iterator w = weights.begin();
+    for (i = bcBuffer.begin(), e = bcBuffer.end(); i != e; ++i) {
+        if (trace) {
+            totalSTA += misoSel.Select(*i, &*w++);
+        } else {
+            size_t STA = misoSel.Select(*i);
+            totalSTA += STA * (*c++);
+        }
+        misoApp.Apply(**i);
+    }
+
+    // Bitcode may go to stdout, so the report goes to stderr.
+    errs() << "STA: " << totalSTA << '\n'
+           << "Applied: " << misoApp.GetApplied() << '\n'
+           << "Skipped: " << misoApp.GetSkipped() << '\n';
+
+    OutFile out(outputPath.empty() ? "-" : outputPath.c_str());
+    if (!out.IsOpen()) {
+        return -1;
+    }
+    WriteBitcodeToFile(module, out.OS());
+    return 0;
+}
+
+int doEval()
+{
+    std::list<NodeArray *> bcBuffer, misoBuffer;
+    std::list<size_t> confBuffer;
+    std::list<std::vector<size_t> > weights;
+    if (parseSelectInputs("eval", misoBuffer, bcBuffer, confBuffer,
+                          weights) < 0) {
+        return -1;
+    }
+
+    int maxDepthVal, immWidthVal, samplesVal, seedVal;
+    if ((maxDepthVal = parseNonNeg(maxDepth, "-max-depth")) < 0) {
+        return -1;
+    }
+    if ((immWidthVal = parseImmWidth()) < 0) {
+        return -1;
+    }
+    if ((samplesVal = parseNonNeg(samples, "-samples")) < 0) {
+        return -1;
+    }
+    if ((seedVal = parseNonNeg(seed, "-seed")) < 0) {
+        return -1;
+    }
+    // Cycles are counted on the first sample.
+    if (samplesVal < 1) {
+        errs() << "eval: -samples should be at least 1\n";
+        return -1;
     }
 
-    MISOSelector misoSel;
+    MISOSelector misoSel(maxDepthVal);
+    misoSel.SetImmediateWidth(immWidthVal);
+    misoSel.SetEnumerate(enumTiles);
+    // xorshift never leaves 0
+    MISOEvaluator misoEval(samplesVal, seedVal + 1);
     std::list<NodeArray *>::iterator i, e;
+    size_t named = 0;
     for (i = misoBuffer.begin(), e = misoBuffer.end(); i != e; ++i) {
-        misoSel.AddInstr(*i);
+        size_t id = misoSel.AddInstr(*i);
+        if (id == named) {
+            misoEval.AddInstr(misoSel.GetRefRPN(id), *i);
+            named++;
+        }
     }
 
     size_t totalSTA = 0;
     std::list<size_t>::iterator c = confBuffer.begin();
-    for (i = bcBuffer.begin(), e = bcBuffer.end(); i != e; ++i, ++c) {
-        size_t STA = misoSel.Select(*i);
-        totalSTA += STA * (*c);
+    std::list<std::vector<size_t> >::iterator w = weights.begin();
+    for (i = bcBuffer.begin(), e = bcBuffer.end(); i != e; ++i) {
+        if (trace) {
+            totalSTA += misoSel.Select(*i, &*w);
+            misoEval.Evaluate(**i, &*w++);
+        } else {
+            size_t STA = misoSel.Select(*i);
+            totalSTA += STA * (*c);
+            // the count of the block weighs every node in it
+            std::vector<size_t> blockWeights((*i)->size(), *c++);
+            misoEval.Evaluate(**i, &blockWeights);
+        }
     }
 
-    outs() << "STA: " << totalSTA << '\n';
+    outs() << "STA: " << totalSTA << '\n'
+           << "Cycles: " << misoEval.GetCycles() << '\n'
+           << "Base: " << misoEval.GetBaseCycles() << '\n'
+           << "Checked: " << misoEval.GetChecked() << '\n'
+           << "Mismatched: " << misoEval.GetMismatched() << '\n';
+    if (misoEval.GetCycles() != totalSTA) {
+        errs() << "eval: STA doesn't count the cycles executed\n";
+        return -1;
+    }
+    return misoEval.GetMismatched() > 0 ? -1 : 0;
+}
+
+// relax selects with instructions whose gains pay for their areas
+// penalized by lambda. Starting from all instructions, the ones that
+// don't pay are disabled until the rest all do. Returns the STA.
+size_t relax(MISOSelector &misoSel, const std::vector<size_t> &areas,
+             double lambda, std::vector<bool> &enabled)
+{
+    enabled.assign(areas.size(), true);
+    std::vector<size_t> gains;
+    for (;;) {
+        size_t STA = misoSel.Solve(enabled, gains);
+        bool changed = false;
+        for (size_t id = 0; id < areas.size(); id++) {
+            if (enabled[id] &&
+                (gains[id] == 0 || gains[id] < lambda * areas[id])) {
+                enabled[id] = false;
+                changed = true;
+            }
+        }
+        if (!changed) {
+            return STA;
+        }
+    }
+}
+
+// areaOf counts the area of the enabled instructions.
+size_t areaOf(MISOSynthesizer::Model model,
+              const std::vector<const NodeArray *> &instrs,
+              const std::vector<bool> &enabled)
+{
+    MISOSynthesizer misoSyn(model);
+    for (size_t id = 0; id < instrs.size(); id++) {
+        if (enabled[id]) {
+            misoSyn.AddInstr(instrs[id]);
+        }
+    }
+    return misoSyn.GetArea();
+}
+
+int doSweep()
+{
+    std::list<NodeArray *> bcBuffer, misoBuffer;
+    std::list<size_t> confBuffer;
+    std::list<std::vector<size_t> > weights;
+    if (parseSelectInputs("sweep", misoBuffer, bcBuffer, confBuffer,
+                          weights) < 0) {
+        return -1;
+    }
+
+    int maxDepthVal, immWidthVal, pointsVal;
+    if ((maxDepthVal = parseNonNeg(maxDepth, "-max-depth")) < 0) {
+        return -1;
+    }
+    if ((immWidthVal = parseImmWidth()) < 0) {
+        return -1;
+    }
+    if ((pointsVal = parseNonNeg(points, "-points")) < 0) {
+        return -1;
+    }
+    MISOSynthesizer::Model model;
+    if (parseAreaModel("sweep", model) < 0) {
+        return -1;
+    }
+
+    // Each instruction is penalized by its own area, while subsets are
+    // measured by the area model.
+    MISOSelector misoSel(maxDepthVal);
+    misoSel.SetImmediateWidth(immWidthVal);
+    misoSel.SetEnumerate(enumTiles);
+    std::vector<size_t> areas;
+    std::vector<const NodeArray *> instrs;
+    std::list<NodeArray *>::iterator i, e;
+    for (i = misoBuffer.begin(), e = misoBuffer.end(); i != e; ++i) {
+        if (misoSel.AddInstr(*i) == areas.size()) {
+            MISOSynthesizer misoSyn(MISOSynthesizer::SumModel);
+            misoSyn.AddInstr(*i);
+            areas.push_back(misoSyn.GetArea());
+            instrs.push_back(*i);
+        }
+    }
+
+    std::list<std::vector<size_t> > blockWeights;
+    prepareBlocks(misoSel, bcBuffer, confBuffer, weights, blockWeights);
+
+    // No instruction pays for its area at maxLambda.
+    std::vector<bool> enabled;
+    std::vector<size_t> gains;
+    relax(misoSel, areas, 0, enabled);
+    misoSel.Solve(enabled, gains);
+    double maxLambda = 1;
+    for (size_t id = 0; id < areas.size(); id++) {
+        if (areas[id] > 0) {
+            maxLambda = std::max(maxLambda, (double)gains[id] / areas[id] * 2);
+        }
+    }
+    size_t fullArea = areaOf(model, instrs, enabled);
+
+    // For each budget, lambda is bisected for the least one whose subset
+    // fits, which has the least STA.
+    outs() << "Budget\tArea\tSTA\tInstrs\n";
+    size_t lastSTA = -1;
+    for (int k = 0; k <= pointsVal; k++) {
+        size_t budget = pointsVal ? fullArea * k / pointsVal : fullArea;
+        double lo = 0, hi = maxLambda;
+        std::vector<bool> best;
+        size_t bestSTA = relax(misoSel, areas, hi, best);
+        // Gains grow as others are dropped, so the subset at maxLambda may
+        // not fit yet. Lambda is raised until it does, or nothing is
+        // selected, which always fits.
+        for (int step = 0;
+             step < 32 && areaOf(model, instrs, best) > budget; step++) {
+            lo = hi;
+            hi *= 2;
+            bestSTA = relax(misoSel, areas, hi, best);
+        }
+        if (areaOf(model, instrs, best) > budget) {
+            best.assign(areas.size(), false);
+            bestSTA = misoSel.Solve(best, gains);
+            lo = hi;
+        }
+        for (int step = 0; step < 32 && hi - lo > 1e-6; step++) {
+            double lambda = (lo + hi) / 2;
+            size_t STA = relax(misoSel, areas, lambda, enabled);
+            if (areaOf(model, instrs, enabled) <= budget) {
+                hi = lambda;
+                best.swap(enabled);
+                bestSTA = STA;
+            } else {
+                lo = lambda;
+            }
+        }
+
+        size_t area = areaOf(model, instrs, best), count = 0;
+        std::string subset;
+        for (size_t id = 0; id < best.size(); id++) {
+            if (best[id]) {
+                subset += misoSel.GetRefRPN(id);
+                subset += '\n';
+                count++;
+            }
+        }
+        // Only points on the Pareto curve are kept.
+        if (bestSTA >= lastSTA) {
+            continue;
+        }
+        lastSTA = bestSTA;
+        outs() << budget << '\t' << area << '\t' << bestSTA << '\t' << count
+               << '\n';
+
+        if (!outputPath.empty()) {
+            std::string path = outputPath + '.' + ToString(budget) + ".txt";
+            OutFile out(path.c_str());
+            if (!out.IsOpen()) {
+                return -1;
+            }
+            out.OS() << subset;
+        }
+    }
+    return 0;
+}
+
+// candidate is an instruction in the queue of doGreedy, ordered by the
+// STA it saves per area.
+// Ties are broken by Tie, then by the least ID.
+struct candidate {
+    double Ratio;
+    size_t ID;
+    double Tie;
+
+    candidate(double ratio, size_t id, double tie = 0)
+        : Ratio(ratio), ID(id), Tie(tie) {}
+
+    bool operator<(const candidate &other) const
+    {
+        if (Ratio != other.Ratio) {
+            return Ratio < other.Ratio;
+        }
+        if (Tie != other.Tie) {
+            return Tie < other.Tie;
+        }
+        return ID > other.ID;
+    }
+};
+
+int doGreedy()
+{
+    std::list<NodeArray *> bcBuffer, misoBuffer;
+    std::list<size_t> confBuffer;
+    std::list<std::vector<size_t> > weights;
+    if (parseSelectInputs("greedy", misoBuffer, bcBuffer, confBuffer,
+                          weights) < 0) {
+        return -1;
+    }
+
+    int maxDepthVal, immWidthVal;
+    if ((maxDepthVal = parseNonNeg(maxDepth, "-max-depth")) < 0) {
+        return -1;
+    }
+    if ((immWidthVal = parseImmWidth()) < 0) {
+        return -1;
+    }
+    MISOSynthesizer::Model model;
+    if (parseAreaModel("greedy", model) < 0) {
+        return -1;
+    }
+
+    // Candidates are ranked by their own areas, while the trajectory is
+    // measured by the area model. Lines count from 0 as prune does.
+    MISOSelector misoSel(maxDepthVal);
+    misoSel.SetImmediateWidth(immWidthVal);
+    misoSel.SetEnumerate(enumTiles);
+    std::vector<size_t> areas, lines;
+    std::vector<const NodeArray *> instrs;
+    std::list<NodeArray *>::iterator i, e;
+    size_t line = 0;
+    for (i = misoBuffer.begin(), e = misoBuffer.end(); i != e; ++i, ++line) {
+        if (misoSel.AddInstr(*i) == areas.size()) {
+            MISOSynthesizer misoSyn(MISOSynthesizer::SumModel);
+            misoSyn.AddInstr(*i);
+            areas.push_back(std::max<size_t>(misoSyn.GetArea(), 1));
+            lines.push_back(line);
+            instrs.push_back(*i);
+        }
+    }
+
+    std::list<std::vector<size_t> > blockWeights;
+    prepareBlocks(misoSel, bcBuffer, confBuffer, weights, blockWeights);
+
+    size_t count = areas.size();
+    std::vector<bool> enabled(count, false);
+    std::vector<size_t> blockCosts;
+    size_t totalSTA = 0;
+    for (size_t b = 0, be = bcBuffer.size(); b < be; b++) {
+        blockCosts.push_back(misoSel.SolveBlock(b, enabled));
+        totalSTA += blockCosts.back();
+    }
+
+    // Gains only shrink as instructions are added, so a candidate whose
+    // gain is fresh on top of the queue is the best. Candidates start
+    // from their gains alone, and are re-evaluated only on top.
+    std::priority_queue<candidate> queue;
+    std::vector<size_t> evaluated(count, -1);
+    for (size_t id = 0; id < count; id++) {
+        if (misoSel.GetBound(id) > 0) {
+            queue.push(candidate((double)misoSel.GetBound(id) / areas[id], id));
+        }
+    }
+
+    MISOSynthesizer misoSyn(model);
+    std::string added;
+    size_t step = 0;
+    outs() << "Area\tSTA\tLine\n";
+    outs() << misoSyn.GetArea() << '\t' << totalSTA << "\t-\n";
+    while (!queue.empty()) {
+        size_t id = queue.top().ID;
+        queue.pop();
+
+        // gain of id with the instructions added
+        enabled[id] = true;
+        size_t before = 0, after = 0;
+        const std::vector<size_t> &blocks = misoSel.GetBlocks(id);
+        std::vector<size_t> costs;
+        for (size_t b = 0; b < blocks.size(); b++) {
+            before += blockCosts[blocks[b]];
+            costs.push_back(misoSel.SolveBlock(blocks[b], enabled));
+            after += costs.back();
+        }
 
+        if (evaluated[id] != step) {
+            enabled[id] = false;
+            evaluated[id] = step;
+            if (before > after) {
+                queue.push(candidate((double)(before - after) / areas[id], id));
+            }
+            continue;
+        }
+
+        for (size_t b = 0; b < blocks.size(); b++) {
+            blockCosts[blocks[b]] = costs[b];
+        }
+        totalSTA = totalSTA - before + after;
+        misoSyn.AddInstr(instrs[id]);
+        added += misoSel.GetRefRPN(id);
+        added += '\n';
+        step++;
+        outs() << misoSyn.GetArea() << '\t' << totalSTA << '\t' << lines[id]
+               << '\n';
+    }
+
+    if (!outputPath.empty()) {
+        OutFile out(outputPath.c_str());
+        if (!out.IsOpen()) {
+            return -1;
+        }
+        out.OS() << added;
+    }
+    return 0;
+}
+
+// application is an entry of the manifest of share, which is selected
+// with its own selector. IDs of instructions are the same in all
+// selectors.
+struct application {
+    ManifestEntry Entry;
+    std::list<NodeArray *> Blocks;
+    std::list<size_t> Confs;
+    std::list<std::vector<size_t> > Weights, BlockWeights;
+    MISOSelector *Sel;
+    std::vector<size_t> BlockCosts;
+    size_t BaseSTA, STA;
+};
+
+// scoreApps scores the applications with STAs (parallel to apps) by
+// their speedups: the weighted mean, or the worst one with ties broken by
+// the weighted mean.
+void scoreApps(const std::list<application> &apps,
+               const std::vector<size_t> &STAs, bool worst, double &score,
+               double &tie)
+{
+    double sum = 0, weights = 0, min = HUGE_VAL;
+    std::list<application>::const_iterator a = apps.begin(), ae = apps.end();
+    for (size_t k = 0; a != ae; ++a, ++k) {
+        double speedup = (double)a->BaseSTA / std::max<size_t>(STAs[k], 1);
+        sum += a->Entry.Weight * speedup;
+        weights += a->Entry.Weight;
+        min = std::min(min, speedup);
+    }
+    double mean = weights > 0 ? sum / weights : 0;
+    score = worst ? min : mean;
+    tie = worst ? mean : 0;
+}
+
+int doShare()
+{
+    if (inputList.size() < 2) {
+        errs() << "share: Requires at least 2 inputs\n";
+        return -1;
+    }
+    std::vector<ManifestEntry> manifest;
+    if (ParseManifest(inputList[0], manifest) < 0) {
+        return -1;
+    }
+    if (manifest.empty()) {
+        errs() << "share: No application in " << inputList[0] << '\n';
+        return -1;
+    }
+
+    // Libraries enumerated for each application are merged, where
+    // isomorphic instructions share the ID of the first one.
+    std::list<NodeArray *> misoBuffer;
+    for (size_t k = 1; k < inputList.size(); k++) {
+        if (ParseMISO(inputList[k], misoBuffer) < 0) {
+            return -1;
+        }
+    }
+
+    int maxDepthVal, immWidthVal, budgetVal;
+    if ((maxDepthVal = parseNonNeg(maxDepth, "-max-depth")) < 0) {
+        return -1;
+    }
+    if ((immWidthVal = parseImmWidth()) < 0) {
+        return -1;
+    }
+    if ((budgetVal = parseNonNeg(budget, "-budget")) < 0) {
+        return -1;
+    }
+    MISOSynthesizer::Model model;
+    if (parseAreaModel("share", model) < 0) {
+        return -1;
+    }
+    bool worst;
+    if (objective == "sum") {
+        worst = false;
+    } else if (objective == "min") {
+        worst = true;
+    } else {
+        errs() << "share: Unknown objective: " << objective << '\n';
+        return -1;
+    }
+
+    // DAGs of all applications are parsed and matched once.
+    std::list<application> apps;
+    std::vector<size_t> STAs;
+    std::vector<size_t> areas;
+    std::vector<const NodeArray *> instrs;
+    std::vector<ManifestEntry>::iterator m = manifest.begin();
+    for (; m != manifest.end(); ++m) {
+        apps.push_back(application());
+        application &app = apps.back();
+        app.Entry = *m;
+        if (parseWorkload(m->Bitcode, m->Conf, app.Blocks, app.Confs,
+                          app.Weights) < 0) {
+            return -1;
+        }
+
+        app.Sel = new MISOSelector(maxDepthVal);
+        app.Sel->SetImmediateWidth(immWidthVal);
+        app.Sel->SetEnumerate(enumTiles);
+        std::list<NodeArray *>::iterator i, e;
+        for (i = misoBuffer.begin(), e = misoBuffer.end(); i != e; ++i) {
+            if (app.Sel->AddInstr(*i) == instrs.size()) {
+                MISOSynthesizer misoSyn(MISOSynthesizer::SumModel);
+                misoSyn.AddInstr(*i);
+                areas.push_back(std::max<size_t>(misoSyn.GetArea(), 1));
+                instrs.push_back(*i);
+            }
+        }
+        prepareBlocks(*app.Sel, app.Blocks, app.Confs, app.Weights,
+                      app.BlockWeights);
+
+        std::vector<bool> none(instrs.size(), false);
+        app.BaseSTA = 0;
+        for (size_t b = 0, be = app.Blocks.size(); b < be; b++) {
+            app.BlockCosts.push_back(app.Sel->SolveBlock(b, none));
+            app.BaseSTA += app.BlockCosts.back();
+        }
+        app.STA = app.BaseSTA;
+        STAs.push_back(app.STA);
+    }
+
+    // The merged library is written in the order of IDs, so that lines
+    // of the trajectory are the IDs.
+    size_t count = instrs.size();
+    if (!libraryPath.empty()) {
+        OutFile out(libraryPath.c_str());
+        if (!out.IsOpen()) {
+            return -1;
+        }
+        for (size_t id = 0; id < count; id++) {
+            out.OS() << apps.front().Sel->GetRefRPN(id) << '\n';
+        }
+    }
+
+    // Instructions are added greedily as greedy does, by the score they
+    // gain per area. Each is evaluated against all applications, on the
+    // blocks where it has tiles.
+    std::vector<bool> enabled(count, false);
+    std::vector<size_t> selected;
+    double score, tie;
+    scoreApps(apps, STAs, worst, score, tie);
+    size_t step = 0, area = 0;
+
+    // Candidates start from the score with their bounds taken from each
+    // application, which the score they gain never exceeds.
+    std::priority_queue<candidate> queue;
+    std::vector<size_t> evaluated(count, -1);
+    for (size_t id = 0; id < count; id++) {
+        std::vector<size_t> boundSTAs(STAs);
+        size_t k = 0;
+        std::list<application>::iterator a, ae = apps.end();
+        for (a = apps.begin(); a != ae; ++a, ++k) {
+            boundSTAs[k] -= std::min(boundSTAs[k], a->Sel->GetBound(id));
+        }
+        double boundScore, boundTie;
+        scoreApps(apps, boundSTAs, worst, boundScore, boundTie);
+        if (boundScore > score || (boundScore == score && boundTie > tie)) {
+            queue.push(candidate((boundScore - score) / areas[id], id,
+                                 (boundTie - tie) / areas[id]));
+        }
+    }
+
+    outs() << "Area\tScore";
+    std::list<application>::iterator a, ae = apps.end();
+    for (a = apps.begin(); a != ae; ++a) {
+        outs() << '\t' << a->Entry.Bitcode;
+    }
+    outs() << "\tLine\n";
+    outs() << area << '\t' << format("%.3f", score);
+    for (a = apps.begin(); a != ae; ++a) {
+        outs() << '\t' << format("%.3f", 1.0);
+    }
+    outs() << "\t-\n";
+
+    while (!queue.empty()) {
+        size_t id = queue.top().ID;
+        queue.pop();
+
+        // STA of each application with id and the instructions added
+        enabled[id] = true;
+        std::vector<size_t> newSTAs(STAs);
+        std::vector<std::vector<size_t> > costs(apps.size());
+        size_t k = 0;
+        for (a = apps.begin(); a != ae; ++a, ++k) {
+            const std::vector<size_t> &blocks = a->Sel->GetBlocks(id);
+            for (size_t b = 0; b < blocks.size(); b++) {
+                costs[k].push_back(a->Sel->SolveBlock(blocks[b], enabled));
+                newSTAs[k] = newSTAs[k] - a->BlockCosts[blocks[b]] +
+                             costs[k].back();
+            }
+        }
+        double newScore, newTie;
+        scoreApps(apps, newSTAs, worst, newScore, newTie);
+
+        if (evaluated[id] != step) {
+            enabled[id] = false;
+            evaluated[id] = step;
+            if (newScore > score || (newScore == score && newTie > tie)) {
+                queue.push(candidate((newScore - score) / areas[id], id,
+                                     (newTie - tie) / areas[id]));
+            }
+            continue;
+        }
+
+        // Area only grows with instructions, so an instruction over the
+        // budget is dropped for good.
+        MISOSynthesizer misoSyn(model);
+        for (size_t s = 0; s < selected.size(); s++) {
+            misoSyn.AddInstr(instrs[selected[s]]);
+        }
+        misoSyn.AddInstr(instrs[id]);
+        if (budgetVal > 0 && misoSyn.GetArea() > (size_t)budgetVal) {
+            enabled[id] = false;
+            continue;
+        }
+
+        k = 0;
+        for (a = apps.begin(); a != ae; ++a, ++k) {
+            const std::vector<size_t> &blocks = a->Sel->GetBlocks(id);
+            for (size_t b = 0; b < blocks.size(); b++) {
+                a->BlockCosts[blocks[b]] = costs[k][b];
+            }
+            a->STA = newSTAs[k];
+        }
+        STAs.swap(newSTAs);
+        score = newScore;
+        tie = newTie;
+        area = misoSyn.GetArea();
+        selected.push_back(id);
+        step++;
+
+        outs() << area << '\t' << format("%.3f", score);
+        for (a = apps.begin(); a != ae; ++a) {
+            outs() << '\t'
+                   << format("%.3f", (double)a->BaseSTA /
+                                         std::max<size_t>(a->STA, 1));
+        }
+        outs() << '\t' << id << '\n';
+    }
+
+    if (!outputPath.empty()) {
+        OutFile out(outputPath.c_str());
+        if (!out.IsOpen()) {
+            return -1;
+        }
+        for (size_t s = 0; s < selected.size(); s++) {
+            out.OS() << apps.front().Sel->GetRefRPN(selected[s]) << '\n';
+        }
+    }
+
+    for (a = apps.begin(); a != ae; ++a) {
+        delete a->Sel;
+    }
     return 0;
 }
 
@@ -136,7 +1158,13 @@ int doArea()
         return -1;
     }
 
-    MISOSynthesizer misoSyn;
+    MISOSynthesizer::Model model;
+    if (parseAreaModel("area", model) < 0) {
+        return -1;
+    }
+
+    AISE_TIMER(AreaTimer);
+    MISOSynthesizer misoSyn(model);
     typedef std::list<NodeArray *>::iterator ln_iter;
     for (ln_iter i = buffer.begin(), e = buffer.end(); i != e; ++i) {
         misoSyn.AddInstr(*i);
@@ -150,15 +1178,35 @@ int doArea()
 int main(int argc, char **argv)
 {
     cl::ParseCommandLineOptions(argc, argv, "AISE: Automatic Instruction Set Extension");
+    // -stats is registered by LLVM
+    Stats::Enabled = AreStatisticsEnabled();
 
+    int ret;
     if (command == "enum") {
-        return doEnum();
+        ret = doEnum();
     } else if (command == "isel") {
-        return doIsel();
+        ret = doIsel();
+    } else if (command == "apply") {
+        ret = doApply();
+    } else if (command == "eval") {
+        ret = doEval();
+    } else if (command == "prune") {
+        ret = doPrune();
+    } else if (command == "sweep") {
+        ret = doSweep();
+    } else if (command == "greedy") {
+        ret = doGreedy();
+    } else if (command == "share") {
+        ret = doShare();
     } else if (command == "area") {
-        return doArea();
+        ret = doArea();
     } else {
         errs() << "main: Unknown command: " << command << '\n';
         return -1;
     }
+
+    if (Stats::Enabled) {
+        Stats::Print(errs());
+    }
+    return ret;
 }
@@ -1,14 +1,241 @@
 #include "node.h"
 #include "miso.h"
 #include "utils.h"
+#include "stats.h"
 #include "llvm/Support/raw_os_ostream.h"
+#include <algorithm>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <queue>
+#include <pthread.h>
+#include <unistd.h>
 
 using namespace aise;
 using namespace llvm;
 
+namespace
+{
+
+// clearIndex resets indexes of nodes before writing RefRPN.
+void clearIndex(const NodeArray &nodes)
+{
+    NodeArray::const_iterator i = nodes.begin(), e = nodes.end();
+    for (; i != e; ++i) {
+        (*i)->Index = 0;
+    }
+}
+
+// markOperands sets indexes of operands of nodes to 1.
+void markOperands(const NodeArray &nodes)
+{
+    NodeArray::const_iterator i = nodes.begin(), e = nodes.end();
+    for (; i != e; ++i) {
+        Node::const_node_iterator p = (*i)->PredBegin(), pe = (*i)->PredEnd();
+        for (; p != pe; ++p) {
+            (*p)->Index = 1;
+        }
+    }
+}
+
+void deleteNodes(const NodeArray &nodes)
+{
+    NodeArray::const_iterator i = nodes.begin(), e = nodes.end();
+    for (; i != e; ++i) {
+        Node::Delete(*i);
+    }
+}
+
+// familyOf returns the associative type of ops of type, the way
+// Node::ToAssociative turns subtractions into sums.
+Node::NodeType familyOf(Node::NodeType type)
+{
+    switch (type) {
+    case Node::SubTy:
+        return Node::AddTy;
+    case Node::DivTy:
+        return Node::MulTy;
+    default:
+        return type;
+    }
+}
+
+// inverseOf returns the type of inverted operands of ops of type.
+Node::NodeType inverseOf(Node::NodeType type)
+{
+    switch (type) {
+    case Node::AddTy:
+        return Node::AddInvTy;
+    case Node::MulTy:
+        return Node::MulInvTy;
+    default:
+        return Node::UnkTy;
+    }
+}
+
+// Direct matching takes time with the number of instructions, while
+// enumerating takes time with the number of cuts, so larger libraries are
+// matched by enumerating. They break even at about this size on the
+// hotspots.
+const size_t maxDirectInstrs = 256;
+
+// invertedHead is added to heads of inverted operands.
+const int invertedHead = Node::FirstInputTy + 1;
+
+// matchesConst checks if constant node of a DAG matches constant pattern,
+// once it's generalized the way Canon copies it.
+bool matchesConst(const Node *pattern, const Node *node, size_t immWidth)
+{
+    if (!node->IsConstant()) {
+        return false;
+    }
+    ConstNode copy(ConstNode::ValueOf(node));
+    ConstNode::Generalize(&copy, immWidth);
+    return copy.Value == ConstNode::ValueOf(pattern);
+}
+
+// isInversion checks if node is an inverted operand of a pattern.
+bool isInversion(const Node *node)
+{
+    return node->TypeOf(Node::AddInvTy) || node->TypeOf(Node::MulInvTy);
+}
+
+// headOf returns the head of an operand of a pattern, which is the type of
+// an op, ConstTy for constants or FirstInputTy for inputs, and is
+// inverted if the operand is an inversion.
+int headOf(const Node *node)
+{
+    int head = 0;
+    if (isInversion(node)) {
+        node = node->Pred.front();
+        head = invertedHead;
+    }
+    if (node->IsInput()) {
+        return head + Node::FirstInputTy;
+    }
+    return head + node->Type;
+}
+
+// headOfTerm returns the head of an operand of a DAG the way headOf does,
+// if it's selected. Nodes that can't be selected are inputs.
+int headOfTerm(const Node *node, bool inverted)
+{
+    int head = inverted ? invertedHead : 0;
+    if (node->IsConstant()) {
+        return head + Node::ConstTy;
+    }
+    if (node->IsOp()) {
+        return head + familyOf(node->Type);
+    }
+    return head + Node::FirstInputTy;
+}
+
+// cacheVersion is the version of the cache files written by
+// MISOEnumerator. Bump it when the instructions found for a DAG change.
+const size_t cacheVersion = 1;
+
+// hashOf returns the 64-bit FNV-1a hash of str.
+uint64_t hashOf(const std::string &str)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0, e = str.size(); i < e; i++) {
+        hash ^= (unsigned char)str[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// hexOf returns the 16 hexadecimal digits of a.
+std::string hexOf(uint64_t a)
+{
+    static const char digits[] = "0123456789abcdef";
+    std::string hex(16, '0');
+    for (int i = 15; i >= 0; i--, a >>= 4) {
+        hex[i] = digits[a & 15];
+    }
+    return hex;
+}
+
+// lowestOperand returns the least of bound and indexes of the operands of
+// node, leaving out virtual nodes.
+size_t lowestOperand(const Node *node, size_t bound)
+{
+    Node::const_node_iterator p = node->PredBegin(), pe = node->PredEnd();
+    for (; p != pe; ++p) {
+        if (!(*p)->TypeOf(Node::UnkTy)) {
+            bound = std::min(bound, (*p)->Index);
+        }
+    }
+    return bound;
+}
+
+// usedBy checks if node is an operand of any node in nodes.
+bool usedBy(const Node *node, const BitVector &nodes)
+{
+    Node::const_node_iterator s = node->SuccBegin(), se = node->SuccEnd();
+    for (; s != se; ++s) {
+        if (nodes.test((*s)->Index)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// depthOf returns the longest path to node from the root of nodes, whose
+// depths are known.
+size_t depthOf(const Node *node, const BitVector &nodes,
+               const std::vector<size_t> &depths)
+{
+    size_t depth = 0;
+    Node::const_node_iterator s = node->SuccBegin(), se = node->SuccEnd();
+    for (; s != se; ++s) {
+        if (nodes.test((*s)->Index)) {
+            depth = std::max(depth, depths[(*s)->Index] + 1);
+        }
+    }
+    return depth;
+}
+
+// firstOutput returns the index of the first output of tile chosen at
+// index, before which the applier inserts the call of the tile.
+size_t firstOutput(const IntriNode *tile, size_t index)
+{
+    NodeArray::const_iterator o = tile->Outputs.begin(), oe;
+    for (oe = tile->Outputs.end(); o != oe; ++o) {
+        index = std::min(index, (*o)->Index);
+    }
+    return index;
+}
+
+} // namespace
+
 namespace aise
 {
 
+MISOEnumerator::reachability::reachability(const NodeArray *_DAG)
+    : DAG(_DAG), Ancestors(_DAG->size(), BitVector(_DAG->size())),
+      Descendants(_DAG->size(), BitVector(_DAG->size())),
+      Depth(_DAG->size())
+{
+    // Operands come before their users in DAG.
+    for (size_t i = 0, e = DAG->size(); i < e; i++) {
+        const Node *node = DAG->at(i);
+        Node::const_node_iterator p = node->PredBegin(), pe = node->PredEnd();
+        for (; p != pe; ++p) {
+            Ancestors[i] |= Ancestors[(*p)->Index];
+            Ancestors[i].set((*p)->Index);
+        }
+    }
+    for (size_t i = DAG->size(); i-- > 0;) {
+        const Node *node = DAG->at(i);
+        Node::const_node_iterator s = node->SuccBegin(), se = node->SuccEnd();
+        for (; s != se; ++s) {
+            Descendants[i] |= Descendants[(*s)->Index];
+            Descendants[i].set((*s)->Index);
+        }
+    }
+}
+
 bool MISOEnumerator::Context::IsOutput(Node *node)
 {
     Node::const_node_iterator i = node->SuccBegin(), e = node->SuccEnd();
@@ -16,7 +243,7 @@ bool MISOEnumerator::Context::IsOutput(Node *node)
     // Constant is not output if one of its successors is selected.
     if (node->TypeOf(Node::ConstTy)) {
         for (; i != e; ++i) {
-            if (Selected.find(*i) != Selected.end()) {
+            if (SelectedBits.test((*i)->Index)) {
                 return false;
             }
         }
@@ -25,133 +252,610 @@ bool MISOEnumerator::Context::IsOutput(Node *node)
 
     // Arithmetic node is output if it's used by nodes outside UpperCone.
     for (; i != e; ++i) {
-        if (Selected.find(*i) == Selected.end()) {
+        if (!SelectedBits.test((*i)->Index)) {
             return true;
         }
     }
     return false;
 }
 
-void MISOEnumerator::Context::Init(Node *root, size_t maxDepth)
+void MISOEnumerator::Context::Init(Node *root, size_t maxDepth,
+                                   size_t window, reachability &reach)
 {
     if (root->Type == Node::UnkTy) {
         return;
     }
 
-    node_heap queue;
-    pushAllPred(root, queue);
+    // Ancestors of root are decided in reversed topological order, so that
+    // successors of a node are decided before it. Nodes below all operands
+    // of the cone can't join it, which ends the scan, and so does a full
+    // window.
+    const BitVector &ancestors = reach.Ancestors[root->Index];
     UpperCone.push_back(root);
-    Selected.insert(root);
-
-    while (!queue.empty()) {
-        Node *node = queue.top();
-        queue.pop();
+    SelectedBits.set(root->Index);
+    reach.Depth[root->Index] = 0;
+    size_t lowest = lowestOperand(root, root->Index);
 
-        // skip nodes that are selected
-        if (Selected.find(node) != Selected.end()) {
+    for (size_t i = root->Index; i-- > lowest;) {
+        Node *node = reach.DAG->at(i);
+        if (!ancestors.test(i) || node->TypeOf(Node::UnkTy)) {
             continue;
         }
         // node should not be output (thus convex)
         if (IsOutput(node)) {
             continue;
         }
-        if (nodeDepth[node] > maxDepth) {
+        size_t depth = depthOf(node, SelectedBits, reach.Depth);
+        if (depth > maxDepth) {
+            AISE_STAT(PrunedDepth);
             continue;
         }
 
         // select the node
-        pushAllPred(node, queue);
+        if (UpperCone.size() == window) {
+            AISE_STAT(PrunedWindow);
+            break;
+        }
+        reach.Depth[i] = depth;
         UpperCone.push_back(node);
-        Selected.insert(node);
+        SelectedBits.set(i);
+        lowest = lowestOperand(node, lowest);
     }
 
-    UpperConeSet.swap(Selected);
+    UpperConeBits.swap(SelectedBits);
 
     if (0) {
-        outs() << "  " << UpperConeSet.size() << ':';
-        node_set::iterator i = UpperConeSet.begin(), e = UpperConeSet.end();
+        outs() << "  " << UpperCone.size() << ':';
+        NodeArray::iterator i = UpperCone.begin(), e = UpperCone.end();
         for (; i != e; ++i) {
-            outs() << ' ' << nodeDepth[*i];
+            outs() << ' ' << reach.Depth[(*i)->Index];
         }
         outs() << '\n';
     }
 }
 
-void MISOEnumerator::Context::pushAllPred(Node *node, node_heap &queue)
+void MISOEnumerator::Context::InitRegion(Node *root, size_t maxDepth,
+                                         size_t window, reachability &reach)
+{
+    if (root->Type == Node::UnkTy) {
+        return;
+    }
+
+    // select all ancestors within maxDepth regardless of convexity
+    // Depth only counts paths through seeds, as in Init.
+    const BitVector &ancestors = reach.Ancestors[root->Index];
+    size_t size = reach.DAG->size();
+    BitVector seeds(size);
+    seeds.set(root->Index);
+    reach.Depth[root->Index] = 0;
+    size_t lowest = lowestOperand(root, root->Index);
+
+    // full tells if the window cut the region short, which is counted once.
+    size_t count = 1;
+    bool full = false;
+    for (size_t i = root->Index; i-- > lowest;) {
+        Node *node = reach.DAG->at(i);
+        if (!ancestors.test(i) || node->TypeOf(Node::UnkTy) ||
+            !usedBy(node, seeds)) {
+            continue;
+        }
+        size_t depth = depthOf(node, seeds, reach.Depth);
+        if (depth > maxDepth) {
+            AISE_STAT(PrunedDepth);
+            continue;
+        }
+        if (count == window) {
+            full = true;
+            break;
+        }
+        reach.Depth[i] = depth;
+        seeds.set(i);
+        count++;
+        lowest = lowestOperand(node, lowest);
+    }
+
+    // Add nodes that share operands with the ancestors, since they can be
+    // extra outputs.
+    NodeArray siblings;
+    for (int i = seeds.find_first(); i >= 0; i = seeds.find_next(i)) {
+        const Node *seed = reach.DAG->at(i);
+        Node::const_node_iterator p = seed->PredBegin(), pe = seed->PredEnd();
+        for (; p != pe; ++p) {
+            Node::const_node_iterator s = (*p)->SuccBegin(), se;
+            for (se = (*p)->SuccEnd(); s != se; ++s) {
+                if ((*s)->Index < root->Index && !(*s)->TypeOf(Node::UnkTy)) {
+                    siblings.push_back(*s);
+                }
+            }
+        }
+    }
+    // A full window keeps the siblings nearest to root.
+    std::sort(siblings.begin(), siblings.end(), Node::LessIndexCompare());
+    NodeArray::reverse_iterator si = siblings.rbegin(), se = siblings.rend();
+    for (; si != se; ++si) {
+        if (seeds.test((*si)->Index)) {
+            continue;
+        }
+        if (count == window) {
+            full = true;
+            break;
+        }
+        seeds.set((*si)->Index);
+        count++;
+    }
+    if (full) {
+        AISE_STAT(PrunedWindow);
+    }
+
+    // Nodes on paths between seeds join the region so that convexity can
+    // be checked inside it. They are reachable from seeds and reach seeds.
+    BitVector forward(size), backward(size);
+    for (int i = seeds.find_first(); i >= 0; i = seeds.find_next(i)) {
+        forward |= reach.Descendants[i];
+        backward |= reach.Ancestors[i];
+    }
+    UpperConeBits = forward;
+    UpperConeBits &= backward;
+    UpperConeBits |= seeds;
+
+    // keep reversed topological order
+    for (size_t i = root->Index + 1; i-- > 0;) {
+        if (UpperConeBits.test(i)) {
+            Node *node = reach.DAG->at(i);
+            Position[node] = UpperCone.size();
+            UpperCone.push_back(node);
+            Candidate.push_back(seeds.test(i));
+        }
+    }
+    Tainted.resize(UpperCone.size(), false);
+}
+
+bool MISOEnumerator::Context::IsTainted(Node *node)
+{
+    Node::const_node_iterator i = node->SuccBegin(), e = node->SuccEnd();
+    for (; i != e; ++i) {
+        if (SelectedBits.test((*i)->Index)) {
+            continue;
+        }
+        // nodes out of the region never reach it
+        std::map<Node *, size_t>::iterator pos = Position.find(*i);
+        if (pos != Position.end() && Tainted[pos->second]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void MISOEnumerator::Context::SelectCut(const NodeArray &cut)
+{
+    // Root is the last node of the cut in topological order.
+    if (UpperCone.empty() || UpperCone[0] != cut[0]) {
+        UpperCone.assign(1, cut[0]);
+    }
+    Outputs = 1;
+
+    NodeArray::const_iterator i = cut.begin(), e = cut.end();
+    for (; i != e; ++i) {
+        Select(*i);
+    }
+    for (i = cut.begin(); i != e; ++i) {
+        Node::const_node_iterator p = (*i)->PredBegin(), pe = (*i)->PredEnd();
+        for (; p != pe; ++p) {
+            if (!SelectedBits.test((*p)->Index)) {
+                Input.insert(*p);
+            }
+        }
+    }
+}
+
+void MISOEnumerator::Context::UnselectAll()
+{
+    while (!order.empty()) {
+        Unselect(order.back());
+    }
+    Input.clear();
+}
+
+void MISOEnumerator::Context::Select(Node *node)
+{
+    Selected.insert(node);
+    SelectedBits.set(node->Index);
+    order.push_back(node);
+}
+
+void MISOEnumerator::Context::Unselect(Node *node)
+{
+    if (history.size() == order.size()) {
+        removeCanon(node);
+    }
+    order.pop_back();
+    Selected.erase(node);
+    SelectedBits.reset(node->Index);
+}
+
+void MISOEnumerator::Context::UpdateCanon(NodeArray &copies)
+{
+    while (history.size() < order.size()) {
+        addCanon(order[history.size()]);
+    }
+    std::vector<change>::reverse_iterator i = history.rbegin(),
+                                          e = history.rend();
+    for (; i != e; ++i) {
+        copies.push_back(i->copy);
+    }
+}
+
+Node *MISOEnumerator::Context::newCopy(const Node *node)
 {
-    size_t predDepth = nodeDepth[node] + 1;
-    Node::node_iterator i = node->Pred.begin(), e = node->Pred.end();
+    Node *copy = Node::FromTypeOfNode(node);
+    if (copy->IsConstant()) {
+        ConstNode::Generalize(copy, ImmWidth);
+    }
+    return copy;
+}
+
+void MISOEnumerator::Context::addCanon(Node *node)
+{
+    history.push_back(change());
+    change &c = history.back();
+    c.helpers = Helpers.size();
+
+    // Node may be copied already as an input of the cut.
+    Node *&copy = Canon[node];
+    c.created = copy == NULL;
+    if (c.created) {
+        copy = newCopy(node);
+    }
+    copy->Type = node->Type;
+    c.copy = copy;
+
+    // Operands are selected after node if ever, so they start as inputs.
+    Node::const_node_iterator i = node->PredBegin(), e = node->PredEnd();
     for (; i != e; ++i) {
-        if (!(*i)->TypeOf(Node::UnkTy)) {
-            queue.push(*i);
-            size_t &depth = nodeDepth[*i];
-            depth = std::max(depth, predDepth);
+        Node *&pred = Canon[*i];
+        if (pred == NULL) {
+            pred = newCopy(*i);
+            pred->Type = Node::UnkTy;
+            c.operands.push_back(*i);
+        }
+        copy->AddPred(pred);
+    }
+
+    std::list<Node *> buffer;
+    copy->ToAssociative(buffer);
+    Helpers.insert(Helpers.end(), buffer.begin(), buffer.end());
+
+    // Merge node into selected associative ops of the same type, so that
+    // associative ops are flattened. Since the ops it was merged into keep
+    // its operands, later merges reach them too.
+    if (!copy->IsAssociative()) {
+        return;
+    }
+    std::vector<change>::iterator si = history.begin(), se = history.end();
+    for (--se; si != se; ++si) {
+        Node *succ = si->copy;
+        if (!succ->TypeOf(copy) ||
+            std::find(succ->Pred.begin(), succ->Pred.end(), copy) ==
+                succ->Pred.end()) {
+            continue;
+        }
+        c.merged.push_back(std::make_pair(succ, succ->Pred));
+
+        // count steps instead of using end() since Pred may increase
+        size_t size = succ->Pred.size(), pos = 0;
+        for (Node::node_iterator j = succ->Pred.begin(); pos < size; ++pos) {
+            if (*j == copy) {
+                succ->Pred.insert(succ->Pred.end(), copy->PredBegin(),
+                                  copy->PredEnd());
+                j = succ->Pred.erase(j);
+            } else {
+                ++j;
+            }
+        }
+    }
+}
+
+void MISOEnumerator::Context::removeCanon(Node *node)
+{
+    change &c = history.back();
+
+    std::list<std::pair<Node *, std::list<Node *> > >::iterator i, e;
+    for (i = c.merged.begin(), e = c.merged.end(); i != e; ++i) {
+        i->first->Pred.swap(i->second);
+    }
+
+    NodeArray::iterator hi = Helpers.begin() + c.helpers, he = Helpers.end();
+    for (; hi != he; ++hi) {
+        Node::Delete(*hi);
+    }
+    Helpers.resize(c.helpers);
+
+    // Restore the type before deleting, which decides the destructor.
+    std::map<Node *, Node *>::iterator copy = Canon.find(node);
+    copy->second->Pred.clear();
+    if (c.created) {
+        copy->second->Type = node->Type;
+        Node::Delete(copy->second);
+        Canon.erase(copy);
+    } else {
+        copy->second->Type = Node::UnkTy;
+    }
+
+    NodeArray::iterator oi = c.operands.begin(), oe = c.operands.end();
+    for (; oi != oe; ++oi) {
+        copy = Canon.find(*oi);
+        copy->second->Type = (*oi)->Type;
+        Node::Delete(copy->second);
+        Canon.erase(copy);
+    }
+
+    history.pop_back();
+}
+
+// pipeline passes cuts from the engines to worker threads in batches, and
+// records them back on the thread of Enumerate in the order they were
+// found. Batches in flight are bounded, so the search waits for the
+// workers instead of buffering all cuts of a DAG.
+class MISOEnumerator::pipeline
+{
+    // cut is a cut to canonicalize, which a worker selects again in a
+    // context of its own.
+    struct cut {
+        NodeArray Nodes; // in reversed topological order
+        size_t Outputs;
+    };
+    struct batch {
+        size_t Seq;
+        // size of the contexts, which must hold the successors of outputs
+        size_t Size;
+        std::vector<cut> Cuts;
+        std::vector<canon> Canons; // parallel to Cuts
+    };
+    static const size_t batchSize = 256;
+
+    MISOEnumerator *owner;
+    std::vector<pthread_t> threads;
+    pthread_mutex_t lock;
+    // ready is signaled when a batch is pending or on stopping, and done
+    // when a batch is finished.
+    pthread_cond_t ready, done;
+    std::deque<batch *> pending;
+    std::map<size_t, batch *> finished; // by Seq
+    bool stopping;
+    // Only the thread of Enumerate uses these.
+    batch *filling;
+    size_t sent, recorded, limit;
+
+    static void *work(void *arg);
+    void canonicalize(batch &b, std::string &rpn);
+    void send();
+    // collect records finished batches in order until at most max batches
+    // are in flight.
+    void collect(size_t max);
+
+  public:
+    // pipeline starts up to jobs workers, see Workers.
+    pipeline(MISOEnumerator *_owner, size_t jobs);
+    ~pipeline();
+
+    // Workers returns the number of workers started.
+    size_t Workers() const { return threads.size(); }
+
+    // Push queues the cut selected in ctx.
+    void Push(const Context &ctx);
+    // Flush records all cuts queued.
+    void Flush();
+};
+
+MISOEnumerator::pipeline::pipeline(MISOEnumerator *_owner, size_t jobs)
+    : owner(_owner), stopping(false), filling(NULL), sent(0), recorded(0)
+{
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&ready, NULL);
+    pthread_cond_init(&done, NULL);
+    for (size_t i = 0; i < jobs; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, work, this) == 0) {
+            threads.push_back(thread);
+        }
+    }
+    limit = threads.size() * 2;
+}
+
+MISOEnumerator::pipeline::~pipeline()
+{
+    Flush();
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    pthread_cond_broadcast(&ready);
+    pthread_mutex_unlock(&lock);
+    for (size_t i = 0, e = threads.size(); i < e; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_cond_destroy(&done);
+    pthread_cond_destroy(&ready);
+    pthread_mutex_destroy(&lock);
+}
+
+void *MISOEnumerator::pipeline::work(void *arg)
+{
+    pipeline *p = static_cast<pipeline *>(arg);
+    std::string rpn;
+    for (;;) {
+        pthread_mutex_lock(&p->lock);
+        while (p->pending.empty() && !p->stopping) {
+            pthread_cond_wait(&p->ready, &p->lock);
+        }
+        if (p->pending.empty()) {
+            pthread_mutex_unlock(&p->lock);
+            return NULL;
+        }
+        batch *b = p->pending.front();
+        p->pending.pop_front();
+        pthread_mutex_unlock(&p->lock);
+
+        p->canonicalize(*b, rpn);
+
+        pthread_mutex_lock(&p->lock);
+        p->finished[b->Seq] = b;
+        pthread_cond_signal(&p->done);
+        pthread_mutex_unlock(&p->lock);
+    }
+}
+
+void MISOEnumerator::pipeline::canonicalize(batch &b, std::string &rpn)
+{
+    // One context selects the cuts of a batch in turn.
+    Context ctx(b.Size);
+    ctx.ImmWidth = owner->immWidth;
+    b.Canons.resize(b.Cuts.size());
+    for (size_t i = 0, e = b.Cuts.size(); i < e; i++) {
+        const cut &c = b.Cuts[i];
+        ctx.SelectCut(c.Nodes);
+        ctx.Outputs = c.Outputs;
+        owner->canonicalize(ctx, rpn, b.Canons[i]);
+        ctx.UnselectAll();
+    }
+}
+
+void MISOEnumerator::pipeline::Push(const Context &ctx)
+{
+    if (filling == NULL) {
+        filling = new batch();
+        filling->Size = 0;
+        filling->Cuts.reserve(batchSize);
+    }
+    filling->Size = std::max(filling->Size, (size_t)ctx.SelectedBits.size());
+    filling->Cuts.push_back(cut());
+    cut &c = filling->Cuts.back();
+    c.Nodes.assign(ctx.Selected.rbegin(), ctx.Selected.rend());
+    c.Outputs = ctx.Outputs;
+    if (filling->Cuts.size() == batchSize) {
+        send();
+    }
+}
+
+void MISOEnumerator::pipeline::send()
+{
+    filling->Seq = sent++;
+    pthread_mutex_lock(&lock);
+    pending.push_back(filling);
+    pthread_cond_signal(&ready);
+    pthread_mutex_unlock(&lock);
+    filling = NULL;
+    collect(limit);
+}
+
+void MISOEnumerator::pipeline::collect(size_t max)
+{
+    for (;;) {
+        batch *b = NULL;
+        pthread_mutex_lock(&lock);
+        while (sent - recorded > max &&
+               (finished.empty() || finished.begin()->first != recorded)) {
+            pthread_cond_wait(&done, &lock);
+        }
+        if (!finished.empty() && finished.begin()->first == recorded) {
+            b = finished.begin()->second;
+            finished.erase(finished.begin());
+        }
+        pthread_mutex_unlock(&lock);
+        if (b == NULL) {
+            return;
+        }
+
+        for (size_t i = 0, e = b->Canons.size(); i < e; i++) {
+            owner->record(b->Canons[i]);
         }
+        recorded++;
+        delete b;
+    }
+}
+
+void MISOEnumerator::pipeline::Flush()
+{
+    if (filling) {
+        send();
     }
+    collect(0);
 }
 
-MISOEnumerator::MISOEnumerator(size_t _maxInput, size_t _maxDepth)
-    : maxInput(_maxInput), maxDepth(_maxDepth) {}
+MISOEnumerator::MISOEnumerator(size_t _maxInput, size_t _maxDepth,
+                               Engine _engine, size_t _maxOutput)
+    : maxInput(_maxInput), maxDepth(_maxDepth), maxOutput(_maxOutput),
+      engine(_engine), immWidth(0), window(0), library(NULL), matcher(NULL),
+      pipe(NULL), jobs(1), blocks(0) {}
+
+MISOEnumerator::~MISOEnumerator() { delete pipe; }
 
 void MISOEnumerator::yield(Context &ctx)
 {
-    typedef std::map<Node *, Node *, Node::LessIndexCompare> node_node_map;
+    AISE_STAT(Yields);
+    if (pipe) {
+        pipe->Push(ctx);
+        return;
+    }
+
+    AISE_TIMER(CanonicalizeTimer);
+    canonicalize(ctx, rpn, current);
+    record(current);
+}
 
-    node_node_map nodeMap;             // old -> new
-    std::map<Node *, Node *> inputMap; // new -> old
-    std::list<Node *> newNodes;
-    std::vector<Node *> inputs; // for permutation
+void MISOEnumerator::canonicalize(Context &ctx, std::string &rpn,
+                                  canon &c) const
+{
+    std::vector<Node *> inputs, copies; // for permutation
+    NodeArray selected, nodes;          // copies of selected nodes
     node_set::iterator i, e;
 
-    // make a copy of selected and input nodes
-    // Only copy Pred, leave Succ and Index empty.
+    c.Root = ctx.UpperCone[0];
+    c.Instr = NULL;
+    c.Inputs.clear();
+    c.Outputs.clear();
+    c.Immediates.clear();
+    c.UsedInside.clear();
+    c.Permutations = 0;
+
+    // Cuts are small, so the buffers are sized once instead of growing.
+    inputs.reserve(ctx.Input.size());
+    copies.reserve(ctx.Input.size());
+    selected.reserve(ctx.Selected.size());
+    nodes.reserve(ctx.Selected.size());
+    ctx.UpdateCanon(selected);
     for (i = ctx.Input.begin(), e = ctx.Input.end(); i != e; ++i) {
-        // input nodes has no type nor predecessor
-        Node *node = new Node();
-        nodeMap[*i] = node;
-        inputMap[node] = *i;
-        inputs.push_back(node);
-    }
-    for (i = ctx.Selected.begin(), e = ctx.Selected.end(); i != e; ++i) {
-        Node *node = Node::FromTypeOfNode(*i);
-        // the mapping should work since selected is in topological order
-        Node::const_node_iterator predIter = (*i)->PredBegin(),
-                                  predEnd = (*i)->PredEnd();
-        for (; predIter != predEnd; ++predIter) {
-            node->AddPred(nodeMap.find(*predIter)->second);
-        }
-        node->ToAssociative(newNodes);
-        nodeMap[*i] = node;
-    }
-
-    // relax order
-    // also build succ relation to find unavailable nodes
-    {
-        node_node_map::iterator i = nodeMap.begin(), e = nodeMap.end();
-        for (; i != e; ++i) {
-            i->second->RelaxOrder(newNodes);
-            i->second->PropagateSucc();
-        }
+        inputs.push_back(*i);
+        copies.push_back(ctx.Canon.find(*i)->second);
     }
-    {
-        std::list<Node *>::iterator i = newNodes.begin(), e = newNodes.end();
-        for (; i != e; ++i) {
-            (*i)->PropagateSucc();
+
+    // Root is always an output. Other outputs are nodes used outside the
+    // cut, except for constants.
+    NodeArray outputs(1, c.Root), roots;
+    if (ctx.Outputs > 1) {
+        for (i = ctx.Selected.begin(), e = ctx.Selected.end(); i != e; ++i) {
+            if (*i != outputs[0] && !(*i)->IsConstant() && ctx.IsOutput(*i)) {
+                outputs.push_back(*i);
+            }
         }
     }
+    NodeArray::iterator o, oe;
+    for (o = outputs.begin(), oe = outputs.end(); o != oe; ++o) {
+        roots.push_back(ctx.Canon.find(*o)->second);
+    }
 
-    // Copy available nodes in nodeMap into newNodes to avoid redundant
-    // sorting, and delete those that are unavailable.
-    Node *root = nodeMap[ctx.UpperCone[0]];
-    {
-        // add nodes in topological order
-        node_node_map::iterator i = nodeMap.begin(), e = nodeMap.end();
-        for (; i != e; ++i) {
-            if (i->second == root || i->second->Succ.size() > 0) {
-                newNodes.push_back(i->second);
-            } else {
-                Node::Delete(i->second);
-            }
+    // Nodes merged into all of their users are unused. Skip them so that
+    // only the available nodes are sorted, in topological order.
+    // Index is used as the mark of used nodes before writing RefRPN.
+    clearIndex(selected);
+    markOperands(selected);
+    markOperands(ctx.Helpers);
+    std::vector<bool> usedInside;
+    for (o = roots.begin(), oe = roots.end(); o != oe; ++o) {
+        usedInside.push_back((*o)->Index > 0);
+        (*o)->Index = 1;
+    }
+    for (o = selected.begin(), oe = selected.end(); o != oe; ++o) {
+        if ((*o)->Index > 0) {
+            nodes.push_back(*o);
         }
     }
 
@@ -159,63 +863,155 @@ void MISOEnumerator::yield(Context &ctx)
     // For instructions like a single constant, the input number is 0 and
     // there is no permutation, thus no instruction is generated.
     Permutation perm(inputs.size());
-    std::string RPN, minRPN;
-    std::vector<size_t> minIndexes;
+    std::string &minRPN = c.RPN;
+    minRPN.clear();
+    std::vector<size_t> minIndexes, minOrder;
+    NodeArray orderedRoots(roots.size());
     while (perm.HasNext()) {
         const std::vector<size_t> &indexes = perm.Next();
         for (int i = indexes.size() - 1; i >= 0; i--) {
-            inputs[i]->Type = (Node::NodeType)(indexes[i] + Node::FirstInputTy);
+            copies[i]->Type = (Node::NodeType)(indexes[i] + Node::FirstInputTy);
         }
 
         // call Sort() in topological order
-        // In fact, only nodes that are not labels are in order, but it
-        // doesn't matter since labels don't need sorting.
+        // Helpers have only one operand and don't need sorting. Ranks
+        // depend on types of inputs, so they are renewed for each order.
         {
-            std::list<Node *>::iterator i, e;
-            for (i = newNodes.begin(), e = newNodes.end(); i != e; ++i) {
-                (*i)->Sort();
-                (*i)->Index = 0;
+            Node::TypeRank rank;
+            NodeArray::iterator i = nodes.begin(), e = nodes.end();
+            for (; i != e; ++i) {
+                (*i)->Sort(&rank);
             }
         }
+        clearIndex(copies);
+        clearIndex(nodes);
+        clearIndex(ctx.Helpers);
+
+        // try each order of outputs
+        Permutation outPerm(roots.size());
+        while (outPerm.HasNext()) {
+            const std::vector<size_t> &order = outPerm.Next();
+            for (int i = order.size() - 1; i >= 0; i--) {
+                orderedRoots[order[i]] = roots[i];
+            }
 
-        RPN.clear();
-        root->WriteRefRPN(RPN);
-        if (minRPN.empty() || RPN < minRPN) {
-            minRPN = RPN;
-            minIndexes = indexes;
+            // Writing stops once it's greater than the best one so far.
+            const std::string *bound = minRPN.empty() ? NULL : &minRPN;
+            rpn.clear();
+            c.Permutations++;
+            if (Node::WriteRefRPN(orderedRoots, rpn, bound) &&
+                (bound == NULL || rpn < minRPN)) {
+                minRPN.swap(rpn);
+                minIndexes = indexes;
+                minOrder = order;
+            }
+
+            if (outPerm.HasNext()) {
+                clearIndex(copies);
+                clearIndex(nodes);
+                clearIndex(ctx.Helpers);
+            }
         }
     }
 
-    if (!minRPN.empty()) {
-        // save instruction if it's new
-        if (instrMap.find(minRPN) == instrMap.end()) {
-            size_t instrIndex = instrMap.size();
-            instrMap[minRPN] = instrIndex;
-        }
+    if (minRPN.empty() || library == NULL) {
+        return;
+    }
 
-        // add instruction to node as a tile
-        IntriNode *tile = new IntriNode();
-        tile->RefRPN = minRPN;
-        std::vector<Node *> orderedInputs(inputs.size());
-        for (int i = minIndexes.size() - 1; i >= 0; i--) {
-            orderedInputs[minIndexes[i]] = inputMap[inputs[i]];
-        }
-        tile->Pred.insert(tile->Pred.end(),
-                          orderedInputs.begin(), orderedInputs.end());
-        ctx.UpperCone[0]->AddTile(tile);
+    // The rest is only needed for tiles.
+    StringMap<IntriNode *>::const_iterator instr = library->find(minRPN);
+    if (instr == library->end()) {
+        return;
+    }
+    c.Instr = instr->second;
+    c.Inputs.resize(inputs.size());
+    for (int i = minIndexes.size() - 1; i >= 0; i--) {
+        c.Inputs[minIndexes[i]] = inputs[i];
     }
 
-    // delete new nodes
-    {
-        std::list<Node *>::iterator i, e;
-        for (i = newNodes.begin(), e = newNodes.end(); i != e; ++i) {
-            Node::Delete(*i);
+    if (outputs.size() > 1) {
+        c.Outputs.resize(outputs.size());
+        c.UsedInside.resize(outputs.size());
+        for (int i = minOrder.size() - 1; i >= 0; i--) {
+            c.Outputs[minOrder[i]] = outputs[i];
+            c.UsedInside[minOrder[i]] = usedInside[i];
         }
     }
-}
+
+    // Write the minimal RefRPN again to find the order of immediates,
+    // which is the order of their indexes.
+    if (ctx.ImmWidth > 0) {
+        for (int i = minIndexes.size() - 1; i >= 0; i--) {
+            copies[i]->Type =
+                (Node::NodeType)(minIndexes[i] + Node::FirstInputTy);
+        }
+        {
+            Node::TypeRank rank;
+            NodeArray::iterator i = nodes.begin(), e = nodes.end();
+            for (; i != e; ++i) {
+                (*i)->Sort(&rank);
+            }
+        }
+        clearIndex(copies);
+        clearIndex(nodes);
+        clearIndex(ctx.Helpers);
+        for (int i = minOrder.size() - 1; i >= 0; i--) {
+            orderedRoots[minOrder[i]] = roots[i];
+        }
+        rpn.clear();
+        Node::WriteRefRPN(orderedRoots, rpn);
+
+        std::map<size_t, Node *> immediates;
+        for (i = ctx.Selected.begin(), e = ctx.Selected.end(); i != e; ++i) {
+            Node *copy = ctx.Canon.find(*i)->second;
+            if (ConstNode::IsImmediate(copy)) {
+                immediates[copy->Index] = *i;
+            }
+        }
+        std::map<size_t, Node *>::iterator m = immediates.begin(), me;
+        for (me = immediates.end(); m != me; ++m) {
+            c.Immediates.push_back(m->second);
+        }
+    }
+}
+
+void MISOEnumerator::record(const canon &c)
+{
+    AISE_STAT_ADD(Permutations, c.Permutations);
+    if (c.RPN.empty()) {
+        return;
+    }
+
+    // save instruction if it's new
+    if (library == NULL) {
+        if (addInstr(c.RPN)) {
+            AISE_STAT(CanonMisses);
+        } else {
+            AISE_STAT(CanonHits);
+        }
+        return;
+    }
+
+    // add instruction to node as a tile if it's in library
+    if (c.Instr == NULL) {
+        AISE_STAT(TilesFiltered);
+        return;
+    }
+    AISE_STAT(TilesKept);
+    IntriNode *tile = new IntriNode();
+    tile->RefRPN = c.RPN;
+    tile->Cost = c.Instr->Cost;
+    tile->Pred.insert(tile->Pred.end(), c.Inputs.begin(), c.Inputs.end());
+    tile->Outputs = c.Outputs;
+    tile->UsedInside = c.UsedInside;
+    tile->Immediates = c.Immediates;
+    c.Root->AddTile(tile);
+}
 
 void MISOEnumerator::recurse(Context &ctx)
 {
+    AISE_STAT(RecurseCalls);
+
     // there must be at least one choice
     bool choice = ctx.Choice.back();
     Node *node = ctx.UpperCone[ctx.Choice.size() - 1];
@@ -229,6 +1025,7 @@ void MISOEnumerator::recurse(Context &ctx)
         // node should not be output (thus convex)
         if (ctx.Choice.size() > 1) { // except root
             if (ctx.IsOutput(node)) {
+                AISE_STAT(PrunedOutput);
                 return;
             }
         }
@@ -239,13 +1036,14 @@ void MISOEnumerator::recurse(Context &ctx)
             if (ctx.Input.find(*i) == ctx.Input.end()) {
                 newInput.push_back(*i);
                 ctx.Input.insert(*i);
-                if (ctx.UpperConeSet.find(*i) == ctx.UpperConeSet.end()) {
+                if (!ctx.UpperConeBits.test((*i)->Index)) {
                     newMandarotyInputs++;
                 }
             }
         }
         // number of mandatory inputs should be within max input
         if (ctx.MandatoryInputs + newMandarotyInputs > maxInput) {
+            AISE_STAT(PrunedInput);
             list_node_iter i = newInput.begin(), e = newInput.end();
             for (; i != e; ++i) {
                 ctx.Input.erase(*i);
@@ -255,7 +1053,7 @@ void MISOEnumerator::recurse(Context &ctx)
         ctx.MandatoryInputs += newMandarotyInputs;
 
         // select node
-        ctx.Selected.insert(node);
+        ctx.Select(node);
         if (ctx.Input.find(node) != ctx.Input.end()) {
             isInput = true;
             ctx.Input.erase(node);
@@ -269,92 +1067,978 @@ void MISOEnumerator::recurse(Context &ctx)
         }
     }
 
-    // recurse
-    if (ctx.Choice.size() < ctx.UpperCone.size()) {
-        ctx.Choice.push_back(true);
-        recurse(ctx);
-        ctx.Choice.pop_back();
-        ctx.Choice.push_back(false);
-        recurse(ctx);
-        ctx.Choice.pop_back();
+    // recurse
+    if (ctx.Choice.size() < ctx.UpperCone.size()) {
+        ctx.Choice.push_back(true);
+        recurse(ctx);
+        ctx.Choice.pop_back();
+        ctx.Choice.push_back(false);
+        recurse(ctx);
+        ctx.Choice.pop_back();
+    }
+
+    // restore selected and inputs
+    if (choice) {
+        ctx.Unselect(node);
+        list_node_iter i = newInput.begin(), e = newInput.end();
+        for (; i != e; ++i) {
+            ctx.Input.erase(*i);
+        }
+        ctx.MandatoryInputs -= newMandarotyInputs;
+        if (isInput) {
+            ctx.Input.insert(node);
+        }
+    }
+}
+
+void MISOEnumerator::expand(Context &ctx, size_t pos)
+{
+    AISE_STAT(ExpandCalls);
+    typedef std::list<Node *>::iterator list_node_iter;
+    size_t excludedInputs = 0;
+
+    for (size_t next = pos + 1; next < ctx.UpperCone.size(); next++) {
+        Node *node = ctx.UpperCone[next];
+
+        // Without room for more outputs, only operands of the cut can be
+        // selected, and other nodes need no bookkeeping.
+        bool isInput = ctx.Input.find(node) != ctx.Input.end();
+        if (!isInput && ctx.Outputs >= maxOutput) {
+            continue;
+        }
+
+        // Since UpperCone is in reversed topological order, all successors
+        // of node have been decided.
+        // Node should not be output, unless there is room for one more
+        // output and it doesn't reach the cut through excluded nodes
+        // (thus convex). Constants are never outputs.
+        bool isOutput = ctx.IsOutput(node), selectable = !isOutput;
+        if (maxOutput > 1) {
+            if (isOutput && !node->IsConstant()) {
+                selectable = ctx.Outputs < maxOutput && !ctx.IsTainted(node);
+            }
+            selectable = selectable && ctx.Candidate[next];
+        }
+
+        if (!selectable) {
+            AISE_STAT(PrunedOutput);
+        } else {
+            std::list<Node *> newInput;
+            size_t newMandatoryInputs = 0;
+
+            // update inputs
+            // Operands always come after node in UpperCone, so none of
+            // them has been excluded yet.
+            Node::node_iterator i = node->Pred.begin(), e = node->Pred.end();
+            for (; i != e; ++i) {
+                if (ctx.Input.find(*i) == ctx.Input.end()) {
+                    newInput.push_back(*i);
+                    ctx.Input.insert(*i);
+                    if (!ctx.UpperConeBits.test((*i)->Index)) {
+                        newMandatoryInputs++;
+                    }
+                }
+            }
+
+            if (ctx.MandatoryInputs + newMandatoryInputs <= maxInput) {
+                ctx.MandatoryInputs += newMandatoryInputs;
+                ctx.Outputs += isOutput;
+                ctx.Select(node);
+                ctx.Input.erase(node);
+
+                if (ctx.Input.size() <= maxInput) {
+                    yield(ctx);
+                }
+                expand(ctx, next);
+
+                ctx.Unselect(node);
+                ctx.Outputs -= isOutput;
+                ctx.MandatoryInputs -= newMandatoryInputs;
+                if (isInput) {
+                    ctx.Input.insert(node);
+                }
+            } else {
+                AISE_STAT(PrunedInput);
+            }
+
+            list_node_iter ni = newInput.begin(), ne = newInput.end();
+            for (; ni != ne; ++ni) {
+                ctx.Input.erase(*ni);
+            }
+        }
+
+        // Node is excluded from now on. If it's used by the cut, it stays
+        // an input of every cut found later in this branch.
+        if (maxOutput > 1) {
+            bool tainted = ctx.IsTainted(node);
+            Node::const_node_iterator i = node->SuccBegin(), e;
+            for (e = node->SuccEnd(); i != e && !tainted; ++i) {
+                tainted = ctx.SelectedBits.test((*i)->Index);
+            }
+            ctx.Tainted[next] = tainted;
+        }
+        if (isInput) {
+            excludedInputs++;
+            if (++ctx.MandatoryInputs > maxInput) {
+                AISE_STAT(PrunedInput);
+                break;
+            }
+        }
+    }
+
+    ctx.MandatoryInputs -= excludedInputs;
+}
+
+void MISOEnumerator::Enumerate(NodeArray *DAG)
+{
+    AISE_TIMER(EnumerateTimer);
+
+    if (DAG->empty()) {
+        return;
+    }
+    if (cacheDir.empty() || library) {
+        search(DAG);
+        return;
+    }
+
+    std::string header = cacheHeader(*DAG);
+    std::string path = cacheDir + '/' + hexOf(hashOf(header)) + ".txt";
+    blocks++;
+    blockInstrs.clear();
+    if (loadBlock(path, header)) {
+        AISE_STAT(CacheHits);
+        return;
+    }
+    AISE_STAT(CacheMisses);
+    search(DAG);
+    saveBlock(path, header);
+}
+
+std::string MISOEnumerator::cacheHeader(const NodeArray &DAG) const
+{
+    // Nodes are written with their operands by Index, so the DAG is
+    // identified by its structure, not by where it's parsed from.
+    std::string nodes;
+    NodeArray::const_iterator i = DAG.begin(), e = DAG.end();
+    for (; i != e; ++i) {
+        AppendInt(nodes, (*i)->Type);
+        if ((*i)->IsConstant()) {
+            nodes += '=';
+            nodes += ConstNode::ValueOf(*i);
+        }
+        Node::const_node_iterator p = (*i)->PredBegin(), pe = (*i)->PredEnd();
+        for (; p != pe; ++p) {
+            nodes += ' ';
+            AppendInt(nodes, (*p)->Index);
+        }
+        nodes += ';';
+    }
+
+    std::string header = "aise-enum ";
+    AppendInt(header, cacheVersion);
+    header += " max-input ";
+    AppendInt(header, maxInput);
+    header += " max-depth ";
+    AppendInt(header, maxDepth);
+    header += " max-output ";
+    AppendInt(header, maxOutput);
+    header += " engine ";
+    AppendInt(header, engine);
+    header += " imm-width ";
+    AppendInt(header, immWidth);
+    header += " window ";
+    AppendInt(header, window);
+    header += " nodes ";
+    AppendInt(header, DAG.size());
+    header += ' ';
+    header += hexOf(hashOf(nodes));
+    return header;
+}
+
+bool MISOEnumerator::loadBlock(const std::string &path,
+                               const std::string &header)
+{
+    std::ifstream in(path.c_str());
+    std::string line;
+    if (!std::getline(in, line) || line != header ||
+        !std::getline(in, line)) {
+        return false;
+    }
+
+    // A file cut short is a miss, so nothing is added before the last
+    // instruction is read.
+    int count;
+    if (ParseInt(line, count) < 0 || count < 0) {
+        return false;
+    }
+    std::vector<std::string> instrs(count);
+    for (int i = 0; i < count; i++) {
+        if (!std::getline(in, instrs[i])) {
+            return false;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        addInstr(instrs[i]);
+    }
+    return true;
+}
+
+void MISOEnumerator::saveBlock(const std::string &path,
+                               const std::string &header)
+{
+    // Write a file of our own and rename it, so that runs sharing the
+    // cache never read a file being written.
+    std::string temp = path + '.' + ToString(getpid());
+    {
+        std::ofstream out(temp.c_str());
+        out << header << '\n' << blockInstrs.size() << '\n';
+        std::vector<std::string>::iterator i = blockInstrs.begin(), e;
+        for (e = blockInstrs.end(); i != e; ++i) {
+            out << *i << '\n';
+        }
+        if (!out) {
+            errs() << "enum: Can't write " << temp << '\n';
+            std::remove(temp.c_str());
+            return;
+        }
+    }
+    if (std::rename(temp.c_str(), path.c_str()) < 0) {
+        errs() << "enum: Can't write " << path << '\n';
+        std::remove(temp.c_str());
+    }
+}
+
+bool MISOEnumerator::addInstr(const std::string &RPN)
+{
+    StringMap<size_t>::iterator i = instrMap.find(RPN);
+    bool found = i != instrMap.end();
+    size_t index;
+    if (found) {
+        index = i->second;
+    } else {
+        index = instrMap.size();
+        instrMap[RPN] = index;
+    }
+
+    if (!cacheDir.empty()) {
+        if (lastBlock.size() <= index) {
+            lastBlock.resize(index + 1, 0);
+        }
+        if (lastBlock[index] != blocks) {
+            lastBlock[index] = blocks;
+            blockInstrs.push_back(RPN);
+        }
+    }
+    return !found;
+}
+
+void MISOEnumerator::search(NodeArray *DAG)
+{
+    if (jobs > 1 && pipe == NULL) {
+        pipe = new pipeline(this, jobs);
+        // Cuts are canonicalized in line if no worker could start.
+        if (pipe->Workers() == 0) {
+            errs() << "enum: Can't start threads, canonicalizing in line\n";
+            delete pipe;
+            pipe = NULL;
+            jobs = 1;
+        }
+    }
+
+    // only try the cuts that may match library
+    // Depths of the engines count paths through the upper cone of root,
+    // so the cuts of each root are checked against its cone, and matching
+    // finds the same tiles as enumerating.
+    if (matcher) {
+        std::vector<NodeArray> cuts;
+        matcher->Match(DAG, maxDepth, immWidth, cuts);
+        reachability reach(DAG);
+        std::vector<NodeArray>::iterator c = cuts.begin(), ce = cuts.end();
+        while (c != ce) {
+            Node *root = c->front();
+            Context ctx(DAG->size());
+            ctx.ImmWidth = immWidth;
+            ctx.Init(root, maxDepth, window, reach);
+            for (; c != ce && c->front() == root; ++c) {
+                yieldCut(ctx, *c);
+            }
+        }
+        if (pipe) {
+            pipe->Flush();
+        }
+        return;
+    }
+
+    // try each node in DAG as root of the MISO instruction
+    reachability reach(DAG);
+    NodeArray::iterator i = DAG->begin(), e = DAG->end();
+    for (; i != e; ++i) {
+        Context ctx(DAG->size());
+        ctx.ImmWidth = immWidth;
+        if (engine == CutEngine && maxOutput > 1) {
+            ctx.InitRegion(*i, maxDepth, window, reach);
+        } else {
+            ctx.Init(*i, maxDepth, window, reach);
+        }
+
+        if (ctx.UpperCone.empty()) {
+            continue;
+        }
+
+        if (engine == CutEngine) {
+            // always select root
+            Node *root = ctx.UpperCone[0];
+            ctx.Select(root);
+            ctx.Outputs = 1;
+            Node::node_iterator p = root->Pred.begin(), pe = root->Pred.end();
+            for (; p != pe; ++p) {
+                if (ctx.Input.insert(*p).second &&
+                    !ctx.UpperConeBits.test((*p)->Index)) {
+                    ctx.MandatoryInputs++;
+                }
+            }
+            if (ctx.MandatoryInputs <= maxInput) {
+                expand(ctx, 0);
+            }
+            ctx.Unselect(root);
+        } else {
+            // always select root
+            ctx.Choice.push_back(true);
+            recurse(ctx);
+        }
+    }
+
+    // Tiles must be in the DAG when it's returned.
+    if (pipe) {
+        pipe->Flush();
+    }
+}
+
+void MISOEnumerator::yieldCut(Context &ctx, const NodeArray &cut)
+{
+    NodeArray::const_iterator i = cut.begin(), e = cut.end();
+    for (; i != e; ++i) {
+        if (!ctx.UpperConeBits.test((*i)->Index)) {
+            return;
+        }
+    }
+
+    ctx.SelectCut(cut);
+    if (ctx.Input.size() <= maxInput) {
+        yield(ctx);
+    }
+    ctx.UnselectAll();
+}
+
+void MISOEnumerator::Save(raw_ostream &out)
+{
+    typedef llvm::StringMap<size_t>::iterator smi;
+    std::vector<std::string> instrArray(instrMap.size());
+    for (smi i = instrMap.begin(), e = instrMap.end(); i != e; ++i) {
+        instrArray[i->second] = i->first();
+    }
+    typedef std::vector<std::string>::iterator vsi;
+    for (vsi i = instrArray.begin(), e = instrArray.end(); i != e; ++i) {
+        out << *i << '\n';
+    }
+}
+
+MISOMatcher::~MISOMatcher()
+{
+    std::vector<NodeArray>::iterator i = patterns.begin(), e = patterns.end();
+    for (; i != e; ++i) {
+        deleteNodes(*i);
+    }
+}
+
+void MISOMatcher::AddPattern(NodeArray &DAG)
+{
+    const Node *root = DAG.back();
+    bucket &b = roots[root->Type];
+    key k;
+    Node::const_node_iterator p = root->PredBegin(), pe = root->PredEnd();
+    for (; p != pe; ++p) {
+        k.push_back(headOf(*p));
+    }
+    if (root->IsAssociative()) {
+        std::sort(k.begin(), k.end());
+    }
+    b.Patterns[k].push_back(patterns.size());
+    b.Arity = std::max(b.Arity, k.size());
+
+    std::set<const Node *> used;
+    NodeArray::const_iterator i = DAG.begin(), e = DAG.end();
+    for (; i != e; ++i) {
+        for (p = (*i)->PredBegin(), pe = (*i)->PredEnd(); p != pe; ++p) {
+            if (!used.insert(*p).second) {
+                shared.insert(*p);
+            }
+        }
+
+        // Operands come first in DAG, so their structures are numbered.
+        std::string structure = "$";
+        if ((*i)->IsConstant()) {
+            structure = ConstNode::ValueOf(*i);
+        } else if (!(*i)->IsInput()) {
+            std::vector<size_t> operands;
+            for (p = (*i)->PredBegin(); p != pe; ++p) {
+                operands.push_back((*p)->Index);
+            }
+            if ((*i)->IsAssociative()) {
+                std::sort(operands.begin(), operands.end());
+            }
+            structure = (*i)->TypeName();
+            for (size_t j = 0, je = operands.size(); j < je; j++) {
+                structure += ' ' + ToString(operands[j]);
+            }
+        }
+        size_t number = structures.size();
+        (*i)->Index = structures.insert(std::make_pair(structure, number))
+                          .first->second;
+        if ((*i)->Index == number) {
+            structureOperands.push_back(assignment());
+            if ((*i)->IsAssociative()) {
+                prepare(*i, structureOperands.back());
+            }
+        }
+    }
+
+    patterns.push_back(NodeArray());
+    patterns.back().swap(DAG);
+}
+
+void MISOMatcher::lookup(const bucket &b, const std::vector<term> &terms,
+                         bool sorted, std::set<size_t> &candidates)
+{
+    // heads of each term besides an input
+    std::vector<int> heads;
+    std::vector<term>::const_iterator t = terms.begin(), te = terms.end();
+    for (; t != te; ++t) {
+        heads.push_back(headOfTerm(t->Operand, t->Inverted));
+    }
+
+    // Each bit of choice makes a term an input.
+    for (size_t choice = 0; choice < (1u << heads.size()); choice++) {
+        key k(heads);
+        bool repeated = false;
+        for (size_t i = 0, e = k.size(); i < e; i++) {
+            if (choice & (1u << i)) {
+                int input = Node::FirstInputTy +
+                            (terms[i].Inverted ? invertedHead : 0);
+                repeated = repeated || k[i] == input;
+                k[i] = input;
+            }
+        }
+        // The same key is looked up with the bit cleared.
+        if (repeated) {
+            continue;
+        }
+        if (sorted) {
+            std::sort(k.begin(), k.end());
+        }
+        std::map<key, std::vector<size_t> >::const_iterator found =
+            b.Patterns.find(k);
+        if (found != b.Patterns.end()) {
+            candidates.insert(found->second.begin(), found->second.end());
+        }
+    }
+}
+
+void MISOMatcher::Match(NodeArray *DAG, size_t maxDepth, size_t immWidth,
+                        std::vector<NodeArray> &cuts) const
+{
+    DenseMap<std::pair<size_t, Node *>, bool> feasibles;
+    query q;
+    q.MaxDepth = maxDepth;
+    q.ImmWidth = immWidth;
+    q.Feasible = &feasibles;
+
+    NodeArray::iterator i = DAG->begin(), e = DAG->end();
+    for (; i != e; ++i) {
+        Node *root = *i;
+        if (!root->IsOp()) {
+            continue;
+        }
+        Node::NodeType type = familyOf(root->Type);
+        std::map<Node::NodeType, bucket>::const_iterator r = roots.find(type);
+        if (r == roots.end()) {
+            continue;
+        }
+
+        // Only patterns whose keys match the operands of root are
+        // searched. Operands of associative ops are merged the same way as
+        // search does.
+        std::set<size_t> candidates;
+        if (root->IsAssociative() || type != root->Type) {
+            std::vector<flattening> options;
+            flatten(root, type, r->second.Arity, options);
+            std::vector<flattening>::iterator o = options.begin(), oe;
+            for (oe = options.end(); o != oe; ++o) {
+                lookup(r->second, o->Terms, true, candidates);
+            }
+        } else {
+            std::vector<term> terms;
+            Node::const_node_iterator p = root->PredBegin(), pe;
+            for (pe = root->PredEnd(); p != pe; ++p) {
+                term t = {*p, false};
+                terms.push_back(t);
+            }
+            lookup(r->second, terms, false, candidates);
+        }
+
+        // A cut may be found by several patterns or orders of operands.
+        // Cuts are kept by the indexes of their nodes, so that they are
+        // yielded in the same order on every run.
+        std::map<std::vector<size_t>, NodeArray> found;
+        q.Root = root;
+        q.Cuts = &found;
+        std::set<size_t>::iterator c = candidates.begin(), ce;
+        for (ce = candidates.end(); c != ce; ++c) {
+            const Node *pattern = patterns[*c].back();
+            if (feasible(pattern, root, q)) {
+                binding b;
+                b.Goals.push_back(std::make_pair(pattern, root));
+                search(b, q);
+            }
+        }
+        std::map<std::vector<size_t>, NodeArray>::iterator f, fe;
+        for (f = found.begin(), fe = found.end(); f != fe; ++f) {
+            cuts.push_back(f->second);
+        }
+    }
+}
+
+void MISOMatcher::flatten(Node *node, Node::NodeType type, size_t limit,
+                          std::vector<flattening> &options)
+{
+    options.assign(1, flattening());
+    size_t pos = 0, size = node->Pred.size();
+    Node::const_node_iterator p = node->PredBegin(), pe = node->PredEnd();
+    for (; p != pe; ++p, ++pos) {
+        term t = {*p, familyOf(node->Type) != node->Type && pos == size - 1};
+        // each operand left adds at least one term
+        size_t rest = size - pos - 1;
+        std::vector<flattening> next;
+        std::vector<flattening>::iterator o = options.begin(), oe;
+        for (oe = options.end(); o != oe; ++o) {
+            if (o->Terms.size() + 1 + rest <= limit) {
+                next.push_back(*o);
+                next.back().Terms.push_back(t);
+            }
+        }
+
+        // An inverted operand is under its inversion, so it's never
+        // merged. Nor is one used by other nodes, which would be an output.
+        if (t.Inverted || familyOf((*p)->Type) != type ||
+            (*p)->Succ.size() != 1 || limit < size + 1) {
+            options.swap(next);
+            continue;
+        }
+        std::vector<flattening> merged;
+        flatten(*p, type, limit - size + 1, merged);
+        for (o = options.begin(); o != oe; ++o) {
+            std::vector<flattening>::iterator m = merged.begin(), me;
+            for (me = merged.end(); m != me; ++m) {
+                if (o->Terms.size() + m->Terms.size() + rest > limit) {
+                    continue;
+                }
+                next.push_back(*o);
+                flattening &f = next.back();
+                f.Terms.insert(f.Terms.end(), m->Terms.begin(),
+                               m->Terms.end());
+                f.Merged.insert(f.Merged.end(), m->Merged.begin(),
+                                m->Merged.end());
+                f.Merged.push_back(*p);
+            }
+        }
+        options.swap(next);
+    }
+}
+
+void MISOMatcher::search(binding &b, const query &q) const
+{
+    // Goals are matched in place until an associative op branches.
+    while (!b.Goals.empty()) {
+        const Node *pattern = b.Goals.back().first;
+        Node *node = b.Goals.back().second;
+        b.Goals.pop_back();
+
+        // Nodes shared in the pattern are shared in the DAG.
+        std::map<const Node *, Node *>::iterator bound =
+            b.Bound.find(pattern);
+        if (bound != b.Bound.end()) {
+            if (bound->second != node) {
+                return;
+            }
+            continue;
+        }
+        b.Bound[pattern] = node;
+
+        if (pattern->IsInput()) {
+            b.Inputs.insert(node);
+            continue;
+        }
+
+        if (pattern->IsConstant()) {
+            if (!matchesConst(pattern, node, q.ImmWidth) ||
+                !b.Selected.insert(node).second) {
+                return;
+            }
+            continue;
+        }
+
+        if (!node->IsOp() || !b.Selected.insert(node).second) {
+            return;
+        }
+        if (!pattern->IsAssociative()) {
+            if (node->Type != pattern->Type ||
+                node->Pred.size() != pattern->Pred.size()) {
+                return;
+            }
+            Node::const_node_iterator p = pattern->PredBegin(), pe;
+            Node::const_node_iterator n = node->PredBegin();
+            for (pe = pattern->PredEnd(); p != pe; ++p, ++n) {
+                b.Goals.push_back(std::make_pair(*p, *n));
+            }
+            continue;
+        }
+
+        if (familyOf(node->Type) != pattern->Type) {
+            return;
+        }
+        assignment a;
+        prepare(pattern, a);
+        std::vector<flattening> options;
+        flatten(node, pattern->Type, a.Operands.size(), options);
+        std::vector<flattening>::iterator o = options.begin(), oe;
+        for (oe = options.end(); o != oe; ++o) {
+            if (o->Terms.size() != a.Operands.size()) {
+                continue;
+            }
+            binding next = b;
+            NodeArray::iterator m = o->Merged.begin(), me = o->Merged.end();
+            for (; m != me && next.Selected.insert(*m).second; ++m) {
+            }
+            if (m != me) {
+                continue;
+            }
+            setTerms(a, o->Terms);
+            assign(next, a, 0, q);
+        }
+        return;
+    }
+    accept(b, q);
+}
+
+void MISOMatcher::prepare(const Node *pattern, assignment &a) const
+{
+    Node::const_node_iterator p = pattern->PredBegin(), pe;
+    for (pe = pattern->PredEnd(); p != pe; ++p) {
+        const Node *operand = *p;
+        a.Heads.push_back(headOf(operand));
+        if (isInversion(operand)) {
+            operand = operand->Pred.front();
+        }
+        a.Operands.push_back(operand);
+        a.Free.push_back(operand->IsInput() &&
+                         shared.find(operand) == shared.end());
+    }
+}
+
+void MISOMatcher::setTerms(assignment &a, std::vector<term> &terms)
+{
+    a.Terms.swap(terms);
+    a.TermHeads.clear();
+    std::vector<term>::iterator t = a.Terms.begin(), te = a.Terms.end();
+    for (; t != te; ++t) {
+        a.TermHeads.push_back(headOfTerm(t->Operand, t->Inverted));
+    }
+    a.Used.assign(a.Operands.size(), false);
+}
+
+bool MISOMatcher::feasible(const Node *pattern, Node *node,
+                           const query &q) const
+{
+    if (pattern->IsInput()) {
+        return true;
+    }
+    std::pair<size_t, Node *> k(pattern->Index, node);
+    DenseMap<std::pair<size_t, Node *>, bool>::iterator found =
+        q.Feasible->find(k);
+    if (found != q.Feasible->end()) {
+        return found->second;
+    }
+
+    bool result = false;
+    if (pattern->IsConstant()) {
+        result = matchesConst(pattern, node, q.ImmWidth);
+    } else if (!node->IsOp()) {
+        result = false;
+    } else if (!pattern->IsAssociative()) {
+        result = node->Type == pattern->Type &&
+                 node->Pred.size() == pattern->Pred.size();
+        Node::const_node_iterator p = pattern->PredBegin(), pe;
+        Node::const_node_iterator n = node->PredBegin();
+        for (pe = pattern->PredEnd(); result && p != pe; ++p, ++n) {
+            result = feasible(*p, *n, q);
+        }
+    } else if (familyOf(node->Type) == pattern->Type) {
+        assignment a(structureOperands[pattern->Index]);
+        std::vector<flattening> options;
+        flatten(node, pattern->Type, a.Operands.size(), options);
+        std::vector<flattening>::iterator o = options.begin(), oe;
+        for (oe = options.end(); o != oe && !result; ++o) {
+            if (o->Terms.size() == a.Operands.size()) {
+                setTerms(a, o->Terms);
+                result = feasibleTerms(a, 0, q);
+            }
+        }
+    }
+    (*q.Feasible)[k] = result;
+    return result;
+}
+
+bool MISOMatcher::compatible(const assignment &a, size_t i, size_t pos,
+                             const query &q) const
+{
+    int input = Node::FirstInputTy +
+                (a.Terms[pos].Inverted ? invertedHead : 0);
+    if (a.Heads[i] == input) {
+        return true;
+    }
+    return a.Heads[i] == a.TermHeads[pos] &&
+           feasible(a.Operands[i], a.Terms[pos].Operand, q);
+}
+
+bool MISOMatcher::feasibleTerms(assignment &a, size_t pos,
+                                const query &q) const
+{
+    if (pos == a.Terms.size()) {
+        return true;
+    }
+    for (size_t i = 0, e = a.Operands.size(); i < e; i++) {
+        if (a.Used[i] || !compatible(a, i, pos, q)) {
+            continue;
+        }
+        a.Used[i] = true;
+        bool result = feasibleTerms(a, pos + 1, q);
+        a.Used[i] = false;
+        if (result) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void MISOMatcher::assign(binding &b, assignment &a, size_t pos,
+                         const query &q) const
+{
+    if (pos == a.Terms.size()) {
+        binding next = b;
+        search(next, q);
+        return;
     }
 
-    // restore selected and inputs
-    if (choice) {
-        ctx.Selected.erase(node);
-        list_node_iter i = newInput.begin(), e = newInput.end();
-        for (; i != e; ++i) {
-            ctx.Input.erase(*i);
+    for (size_t i = 0, e = a.Operands.size(); i < e; i++) {
+        if (a.Used[i] || !compatible(a, i, pos, q)) {
+            continue;
         }
-        ctx.MandatoryInputs -= newMandarotyInputs;
-        if (isInput) {
-            ctx.Input.insert(node);
+        // Free operands are taken in order, since swapping them finds the
+        // same cut.
+        bool swapped = false;
+        for (size_t j = 0; j < i && a.Free[i] && !swapped; j++) {
+            swapped = a.Free[j] && !a.Used[j] && a.Heads[j] == a.Heads[i];
+        }
+        if (swapped) {
+            continue;
         }
+        a.Used[i] = true;
+        b.Goals.push_back(std::make_pair(a.Operands[i], a.Terms[pos].Operand));
+        assign(b, a, pos + 1, q);
+        b.Goals.pop_back();
+        a.Used[i] = false;
     }
 }
 
-void MISOEnumerator::Enumerate(NodeArray *DAG)
+void MISOMatcher::accept(const binding &b, const query &q) const
 {
-    if (DAG->empty()) {
-        return;
+    node_set::const_iterator i = b.Inputs.begin(), e = b.Inputs.end();
+    for (; i != e; ++i) {
+        if (b.Selected.find(*i) != b.Selected.end()) {
+            return;
+        }
     }
 
-    // try each node in DAG as root of the MISO instruction
-    NodeArray::iterator i = DAG->begin(), e = DAG->end();
-    for (; i != e; ++i) {
-        Context ctx;
-        ctx.Init(*i, maxDepth);
+    // Selected nodes other than root are only used inside the cut, as
+    // Context::IsOutput checks.
+    for (i = b.Selected.begin(), e = b.Selected.end(); i != e; ++i) {
+        if (*i == q.Root || (*i)->IsConstant()) {
+            continue;
+        }
+        Node::const_node_iterator s = (*i)->SuccBegin(), se = (*i)->SuccEnd();
+        for (; s != se; ++s) {
+            if (b.Selected.find(*s) == b.Selected.end()) {
+                return;
+            }
+        }
+    }
 
-        if (!ctx.UpperCone.empty()) {
-            // always select root
-            ctx.Choice.push_back(true);
-            recurse(ctx);
+    // depth of each node is the longest path from root in the cut
+    std::map<Node *, size_t> depth;
+    std::vector<size_t> indexes;
+    NodeArray cut;
+    node_set::const_reverse_iterator ri = b.Selected.rbegin(),
+                                     re = b.Selected.rend();
+    for (; ri != re; ++ri) {
+        size_t predDepth = depth[*ri] + 1;
+        if (predDepth - 1 > q.MaxDepth) {
+            return;
+        }
+        Node::const_node_iterator p = (*ri)->PredBegin(), pe = (*ri)->PredEnd();
+        for (; p != pe; ++p) {
+            size_t &d = depth[*p];
+            d = std::max(d, predDepth);
         }
+        indexes.push_back((*ri)->Index);
+        cut.push_back(*ri);
     }
+    (*q.Cuts)[indexes].swap(cut);
 }
 
-void MISOEnumerator::Save(raw_ostream &out)
+void LegalizeDAG(NodeArray *DAG)
 {
-    typedef llvm::StringMap<size_t>::iterator smi;
-    std::vector<std::string> instrArray(instrMap.size());
-    for (smi i = instrMap.begin(), e = instrMap.end(); i != e; ++i) {
-        instrArray[i->second] = i->first();
-    }
-    typedef std::vector<std::string>::iterator vsi;
-    for (vsi i = instrArray.begin(), e = instrArray.end(); i != e; ++i) {
-        out << *i << '\n';
+    AISE_TIMER(LegalizeTimer);
+    for (size_t index = 0, size = DAG->size(); index < size; index++) {
+        DAG->at(index)->Index = index;
+        DAG->at(index)->PropagateSucc();
     }
 }
 
-void LegalizeDAG(NodeArray *DAG)
+size_t CriticalPathDelay(const NodeArray &DAG, const NodeArray &roots)
 {
-    NodeArray legalDAG;
-    NodeArray::iterator i = DAG->begin(), e = DAG->end();
+    typedef std::priority_queue<size_t, std::vector<size_t>,
+                                std::greater<size_t> >
+        time_heap;
+
+    // ready is when the result of a node is ready. Sums and products
+    // are also available as two numbers in carry-save form at partial.
+    size_t size = DAG.size();
+    std::vector<size_t> ready(size, 0), partial(size, 0);
+    std::vector<bool> carrySave(size, false);
+    for (size_t i = 0; i < size; i++) {
+        DAG[i]->Index = i;
+    }
 
-    for (; i != e; ++i) {
-        size_t size = (*i)->Pred.size();
-        if (!(*i)->IsAssociative() && size > 1) {
-            std::list<Node *>::iterator p = (*i)->Pred.begin();
-            size_t index = 1;
-            for (++p; index < size && index < 3; index++) {
-                Node *label = Node::FromType(Node::Order1Ty + index - 1);
-                label->AddPred(*p);
-                *p = label;
-                legalDAG.push_back(label);
+    for (size_t i = 0; i < size; i++) {
+        Node *node = DAG[i];
+        if (node->Pred.empty()) {
+            continue;
+        }
+
+        // Virtual successors are not operations.
+        size_t first = (*node->PredBegin())->Index;
+        if (node->TypeOf(Node::UnkTy)) {
+            ready[i] = ready[first];
+            partial[i] = partial[first];
+            carrySave[i] = carrySave[first];
+            continue;
+        }
+
+        time_heap times;
+        Node::const_node_iterator p = node->PredBegin(), pe = node->PredEnd();
+        size_t maxTime = 0;
+        for (; p != pe; ++p) {
+            maxTime = std::max(maxTime, ready[(*p)->Index]);
+        }
+        size_t cost = Node::TypeCost(node->Type);
+
+        switch (node->Type) {
+        case Node::AddTy:
+        case Node::SubTy: {
+            // Reduce operands by carry-save adders, then add the last two.
+            // Operands in carry-save form skip their carry propagation.
+            for (p = node->PredBegin(); p != pe; ++p) {
+                size_t index = (*p)->Index;
+                if (carrySave[index]) {
+                    times.push(partial[index]);
+                    times.push(partial[index]);
+                } else {
+                    times.push(ready[index]);
+                }
+            }
+            while (times.size() > 2) {
+                size_t time = 0;
+                for (int k = 0; k < 3; k++) {
+                    time = std::max(time, times.top());
+                    times.pop();
+                }
+                times.push(time + Node::CarrySaveCost);
+                times.push(time + Node::CarrySaveCost);
+            }
+            times.pop();
+            partial[i] = times.top();
+            ready[i] = partial[i] + cost;
+            carrySave[i] = true;
+        } break;
+
+        case Node::AddInvTy:
+            // Negation folds into the adder, even in carry-save form.
+            ready[i] = ready[first] + cost;
+            partial[i] = partial[first];
+            carrySave[i] = carrySave[first];
+            break;
+
+        case Node::ShlTy:
+        case Node::LshrTy:
+        case Node::AshrTy: {
+            // Shift by constant is wiring, but shift by immediate needs a
+            // shifter.
+            const Node *amount = node->Pred.back();
+            bool wiring = amount->IsConstant() &&
+                          !ConstNode::IsImmediate(amount);
+            ready[i] = wiring ? ready[first] : maxTime + cost;
+        } break;
+
+        default:
+            if (!node->IsAssociative()) {
+                ready[i] = maxTime + cost;
+                break;
+            }
+            // Balance the tree by combining the two operands ready first.
+            for (p = node->PredBegin(); p != pe; ++p) {
+                times.push(ready[(*p)->Index]);
+            }
+            while (times.size() > 1) {
+                times.pop();
+                size_t time = times.top();
+                times.pop();
+                times.push(time + cost);
+            }
+            ready[i] = times.top();
+
+            // The last step of a multiplier adds its partial products, but
+            // a divider gives no carry-save form.
+            bool divides = false;
+            for (p = node->PredBegin(); p != pe && !divides; ++p) {
+                divides = (*p)->TypeOf(Node::MulInvTy);
+            }
+            if (node->TypeOf(Node::MulTy) && !divides) {
+                size_t addCost = Node::TypeCost(Node::AddTy);
+                partial[i] = ready[i] > addCost ? ready[i] - addCost : 0;
+                carrySave[i] = true;
             }
         }
-        legalDAG.push_back(*i);
     }
 
-    for (size_t index = 0, size = legalDAG.size(); index < size; index++) {
-        legalDAG[index]->Index = index;
-        legalDAG[index]->PropagateSucc();
+    size_t delay = 0;
+    NodeArray::const_iterator r = roots.begin(), re = roots.end();
+    for (; r != re; ++r) {
+        delay = std::max(delay, ready[(*r)->Index]);
     }
-
-    DAG->swap(legalDAG);
+    return delay;
 }
 
-void MISOSelector::AddInstr(const NodeArray *DAG)
+size_t MISOSelector::AddInstr(const NodeArray *DAG)
 {
     NodeArray instrDAG;
     instrDAG.reserve(DAG->size());
@@ -375,44 +2059,75 @@ void MISOSelector::AddInstr(const NodeArray *DAG)
         }
     }
 
+    // Multi-output instruction ends with a virtual successor for each
+    // output. Otherwise the last node is the only output.
+    NodeArray roots;
+    {
+        NodeArray::reverse_iterator i = instrDAG.rbegin(), e;
+        for (e = instrDAG.rend(); i != e && (*i)->TypeOf(Node::UnkTy); ++i) {
+            roots.insert(roots.begin(), *(*i)->PredBegin());
+        }
+        if (roots.empty()) {
+            roots.push_back(instrDAG.back());
+        }
+    }
+
     std::string RPN;
-    instrDAG.back()->WriteRefRPN(RPN);
+    Node::WriteRefRPN(roots, RPN);
 
     // calculate cost
-    // use Index to keep the cost value
     {
         NodeArray::iterator i = instrDAG.begin(), e = instrDAG.end();
         size_t inputCount = 0;
         for (; i != e; ++i) {
-            (*i)->Index = (*i)->CriticalPathCost();
             if ((*i)->IsInput()) {
                 inputCount++;
             }
         }
         maxInput = std::max(maxInput, inputCount);
+        maxOutput = std::max(maxOutput, roots.size());
     }
-    size_t rootCost = instrDAG.back()->Index;
+    StringMap<IntriNode *>::iterator found = instrMap.find(RPN);
+    if (found != instrMap.end()) {
+        deleteNodes(instrDAG);
+        return found->second->Index;
+    }
+
+    size_t rootCost = CriticalPathDelay(instrDAG, roots);
 
     // save instruction
+    // An instruction takes as many cycles as its critical path needs, and
+    // each extra output takes one more cycle to write back. The cost is
+    // kept in the library, so each instruction is timed only once.
     IntriNode *intriNode = new IntriNode();
     intriNode->Pred.resize(1, NULL);
     intriNode->RefRPN = RPN;
-    intriNode->Cost = Node::RoundUpUnitCost(rootCost);
+    intriNode->Cost = Node::RoundUpUnitCost(rootCost) +
+                      (roots.size() - 1) * Node::OutputCost;
+    intriNode->Index = instrList.size();
     instrMap[intriNode->RefRPN] = intriNode;
+    instrList.push_back(intriNode);
+    blocks.resize(instrList.size());
+    bounds.resize(instrList.size());
 
-    // delete copied nodes
-    {
-        NodeArray::iterator i = instrDAG.begin(), e = instrDAG.end();
-        for (; i != e; ++i) {
-            Node::Delete(*i);
-        }
+    if (roots.size() == 1) {
+        matcher.AddPattern(instrDAG);
     }
+    deleteNodes(instrDAG);
+    return intriNode->Index;
 }
 
-size_t MISOSelector::Select(NodeArray *DAG)
+void MISOSelector::matchTiles(NodeArray *DAG)
 {
     // find all possible tiles for each node in the DAG
-    MISOEnumerator misoEnum(maxInput, maxDepth);
+    // Only tiles of configured instructions are kept.
+    MISOEnumerator misoEnum(maxInput, maxDepth, MISOEnumerator::CutEngine,
+                            maxOutput);
+    misoEnum.SetLibrary(&instrMap);
+    misoEnum.SetImmediateWidth(immWidth);
+    if (!enumerate && maxOutput == 1 && instrList.size() <= maxDirectInstrs) {
+        misoEnum.SetMatcher(&matcher);
+    }
     misoEnum.Enumerate(DAG);
 
     for (size_t i = 0, e = DAG->size(); i != e; ++i) {
@@ -420,28 +2135,24 @@ size_t MISOSelector::Select(NodeArray *DAG)
         Node *node = DAG->at(i);
         node->Index = i;
 
-        // filter tiles found in enum stage and assigned costs to them
-        std::list<IntriNode *>::iterator t = node->TileList.begin();
-        typedef StringMap<IntriNode *>::iterator in_iter;
-        while (t != node->TileList.end()) {
-            in_iter inIter = instrMap.find((*t)->RefRPN);
-            if (inIter == instrMap.end()) {
-                t = node->TileList.erase(t);
-            } else {
-                (*t)->Cost = inIter->second->Cost;
-                ++t;
-            }
-        }
-
         // add default tile
         node->AddTile(IntriNode::TileOfNode(node));
     }
+}
+
+size_t MISOSelector::Select(NodeArray *DAG, const std::vector<size_t> *weights)
+{
+    matchTiles(DAG);
 
     context ctx;
     ctx.DAG.swap(*DAG);
+    ctx.Weights = weights;
 
-    buttomUp(ctx);
-    topDown(ctx);
+    {
+        AISE_TIMER(SelectTimer);
+        buttomUp(ctx);
+        topDown(ctx);
+    }
 
     while (0) {
         NodeArray::iterator i = ctx.DAG.begin(), e = ctx.DAG.end();
@@ -460,16 +2171,278 @@ size_t MISOSelector::Select(NodeArray *DAG)
         }
     }
 
+    // delete tiles that are not matched
+    std::set<IntriNode *> matched;
+    for (size_t i = 0, e = ctx.DAG.size(); i < e; i++) {
+        if (ctx.Matched[i]) {
+            matched.insert(ctx.BestTile[i]);
+        }
+    }
+    for (size_t i = 0, e = ctx.DAG.size(); i < e; i++) {
+        std::list<IntriNode *>::iterator t = ctx.DAG[i]->TileList.begin(),
+                                         te = ctx.DAG[i]->TileList.end();
+        for (; t != te; ++t) {
+            if (matched.find(*t) == matched.end()) {
+                Node::Delete(*t);
+            }
+        }
+    }
+
     // assign tiling to DAG
+    // A multi-output tile is executed once, at its first output, where
+    // the applier inserts it. Other tiles may have taken that output
+    // since, so the tile is charged where it's first met.
     size_t cost = 0;
+    std::set<IntriNode *> executed;
     for (size_t i = 0, e = ctx.DAG.size(); i < e; i++) {
         ctx.DAG[i]->TileList.clear();
         if (ctx.Matched[i]) {
-            ctx.DAG[i]->TileList.push_back(ctx.BestTile[i]);
-            cost += ctx.BestTile[i]->Cost;
+            IntriNode *tile = ctx.BestTile[i];
+            ctx.DAG[i]->TileList.push_back(tile);
+            if (tile->Outputs.empty() || executed.insert(tile).second) {
+                cost += tile->Cost * ctx.WeightOf(firstOutput(tile, i));
+            }
+        }
+    }
+
+    ctx.DAG.swap(*DAG);
+    return cost;
+}
+
+void MISOSelector::Profile(NodeArray *DAG, const std::vector<size_t> *weights)
+{
+    matchTiles(DAG);
+
+    context ctx;
+    ctx.DAG.swap(*DAG);
+    ctx.Weights = weights;
+
+    // cost of each node with default tiles only
+    size_t size = ctx.DAG.size();
+    ctx.MinCost.resize(size);
+    ctx.BestTile.resize(size);
+    for (size_t i = 0; i < size; i++) {
+        ctx.BestTile[i] = ctx.DAG[i]->TileList.back();
+        ctx.MinCost[i] = sumCost(ctx.BestTile[i], i, ctx);
+    }
+
+    sites.resize(instrList.size());
+    for (size_t i = 0; i < size; i++) {
+        std::list<IntriNode *> &tiles = ctx.DAG[i]->TileList;
+        std::list<IntriNode *>::iterator t = tiles.begin(), te = tiles.end();
+        for (--te; t != te; ++t) {
+            size_t cost = sumCost(*t, i, ctx);
+            AISE_STAT(Relaxations);
+            size_t gain = ctx.MinCost[i] > cost ? ctx.MinCost[i] - cost : 0;
+            std::vector<Site> &instrSites =
+                sites[instrMap[(*t)->RefRPN]->Index];
+            Node::Delete(*t);
+
+            // An instruction may match a node in more than one way, where
+            // the best one is kept.
+            if (!instrSites.empty() && instrSites.back().Block == profiled &&
+                instrSites.back().Node == i) {
+                instrSites.back().Gain = std::max(instrSites.back().Gain, gain);
+                continue;
+            }
+            Site site;
+            site.Block = profiled;
+            site.Node = i;
+            site.Weight = ctx.WeightOf(i);
+            site.Gain = gain;
+            instrSites.push_back(site);
+        }
+        Node::Delete(*te);
+        tiles.clear();
+    }
+
+    ctx.DAG.swap(*DAG);
+    profiled++;
+}
+
+void MISOSelector::Prune(const std::vector<size_t> &areas,
+                         std::vector<size_t> &result)
+{
+    size_t count = instrList.size();
+    sites.resize(count);
+
+    // instructions that gain at each site, with their gains
+    typedef std::pair<size_t, size_t> position;
+    typedef std::map<size_t, size_t> gain_map;
+    std::map<position, gain_map> gainAt;
+    for (size_t id = 0; id < count; id++) {
+        std::vector<Site>::const_iterator s = sites[id].begin(), e;
+        for (e = sites[id].end(); s != e; ++s) {
+            if (s->Gain > 0) {
+                gainAt[position(s->Block, s->Node)][id] = s->Gain;
+            }
+        }
+    }
+
+    // number of sites with gain of each instruction
+    std::vector<size_t> gainful(count, 0);
+    {
+        std::map<position, gain_map>::const_iterator i, e;
+        for (i = gainAt.begin(), e = gainAt.end(); i != e; ++i) {
+            gain_map::const_iterator g = i->second.begin(), ge;
+            for (ge = i->second.end(); g != ge; ++g) {
+                gainful[g->first]++;
+            }
+        }
+    }
+
+    result.assign(count, -1);
+    for (size_t id = 0; id < count; id++) {
+        if (gainful[id] == 0) {
+            continue;
+        }
+        result[id] = id;
+
+        // Dominators of id gain at each of its sites, so only instructions
+        // gaining at its first site are tried.
+        std::vector<Site>::const_iterator first = sites[id].begin(), e;
+        for (e = sites[id].end(); first->Gain == 0; ++first)
+            ;
+        const gain_map &rivals = gainAt[position(first->Block, first->Node)];
+        gain_map::const_iterator r = rivals.begin(), re = rivals.end();
+        for (; r != re && result[id] == id; ++r) {
+            size_t rival = r->first;
+            if (rival == id || areas[rival] > areas[id]) {
+                continue;
+            }
+
+            // Rival has to be better than id somewhere, or win a tie by
+            // its ID, so that two instructions never dominate each other.
+            bool dominated = true;
+            bool better = areas[rival] < areas[id] || rival < id ||
+                          gainful[rival] > gainful[id];
+            std::vector<Site>::const_iterator s;
+            for (s = first; s != e && dominated; ++s) {
+                const gain_map &gains = gainAt[position(s->Block, s->Node)];
+                gain_map::const_iterator own = gains.find(id);
+                if (own == gains.end()) {
+                    continue;
+                }
+                gain_map::const_iterator g = gains.find(rival);
+                dominated = g != gains.end() && g->second >= own->second;
+                better = better || (dominated && g->second > own->second);
+            }
+            if (dominated && better) {
+                result[id] = rival;
+            }
+        }
+    }
+}
+
+void MISOSelector::Prepare(NodeArray *DAG, const std::vector<size_t> *weights)
+{
+    matchTiles(DAG);
+
+    size_t block = prepared.size();
+    prepared.push_back(context());
+    context &ctx = prepared.back();
+    ctx.DAG = *DAG;
+    ctx.Weights = weights;
+
+    // cost of each node with default tiles only
+    size_t size = ctx.DAG.size();
+    ctx.MinCost.resize(size);
+    ctx.BestTile.resize(size);
+    for (size_t i = 0; i < size; i++) {
+        ctx.BestTile[i] = ctx.DAG[i]->TileList.back();
+        ctx.MinCost[i] = sumCost(ctx.BestTile[i], i, ctx);
+    }
+
+    // Tiles are indexed by the IDs of their instructions, so that Solve
+    // needn't look them up.
+    for (size_t i = 0; i < size; i++) {
+        std::list<IntriNode *> &tiles = ctx.DAG[i]->TileList;
+        std::list<IntriNode *>::iterator t = tiles.begin(), te = tiles.end();
+        std::map<size_t, size_t> gains;
+        for (--te; t != te; ++t) {
+            size_t id = instrMap[(*t)->RefRPN]->Index;
+            size_t cost = sumCost(*t, i, ctx);
+            size_t gain = ctx.MinCost[i] > cost ? ctx.MinCost[i] - cost : 0;
+            (*t)->Index = id;
+            gains[id] = std::max(gains[id], gain);
+            if (blocks[id].empty() || blocks[id].back() != block) {
+                blocks[id].push_back(block);
+            }
+        }
+        std::map<size_t, size_t>::iterator g = gains.begin(), ge;
+        for (ge = gains.end(); g != ge; ++g) {
+            bounds[g->first] += g->second;
+        }
+    }
+}
+
+size_t MISOSelector::Solve(const std::vector<bool> &enabled,
+                           std::vector<size_t> &gains)
+{
+    AISE_TIMER(SelectTimer);
+    gains.assign(instrList.size(), 0);
+
+    size_t cost = 0;
+    std::vector<context>::iterator c = prepared.begin(), ce = prepared.end();
+    for (; c != ce; ++c) {
+        c->Enabled = &enabled;
+        cost += solve(*c, &gains);
+    }
+    return cost;
+}
+
+size_t MISOSelector::SolveBlock(size_t block, const std::vector<bool> &enabled)
+{
+    AISE_TIMER(SelectTimer);
+    context &ctx = prepared[block];
+    ctx.Enabled = &enabled;
+    return solve(ctx, NULL);
+}
+
+size_t MISOSelector::solve(context &ctx, std::vector<size_t> *gains)
+{
+    size_t size = ctx.DAG.size();
+    buttomUp(ctx);
+
+    // topDown gives each output of a multi-output tile the tile, so the
+    // node choosing it is taken before.
+    std::vector<IntriNode *> chosen(ctx.BestTile);
+    topDown(ctx);
+
+    size_t cost = 0;
+    std::vector<std::pair<IntriNode *, size_t> > selected;
+    std::set<IntriNode *> counted, executed;
+    for (size_t i = 0; i < size; i++) {
+        if (!ctx.Matched[i]) {
+            continue;
+        }
+        IntriNode *tile = ctx.BestTile[i];
+        if (tile->Outputs.empty() || executed.insert(tile).second) {
+            cost += tile->Cost * ctx.WeightOf(firstOutput(tile, i));
+        }
+        if (gains && !tile->RefRPN.empty() && chosen[i] == tile &&
+            counted.insert(tile).second) {
+            selected.push_back(std::make_pair(tile, i));
         }
     }
+    if (!gains) {
+        return cost;
+    }
 
+    // Gains are taken as Profile does, against default tiles around each
+    // tile, so that they add up to the cost saved by the tiling.
+    for (size_t i = 0; i < size; i++) {
+        ctx.BestTile[i] = ctx.DAG[i]->TileList.back();
+        ctx.MinCost[i] = sumCost(ctx.BestTile[i], i, ctx);
+    }
+    std::vector<std::pair<IntriNode *, size_t> >::iterator s, se;
+    for (s = selected.begin(), se = selected.end(); s != se; ++s) {
+        size_t tileCost = sumCost(s->first, s->second, ctx);
+        size_t defaultCost = ctx.MinCost[s->second];
+        if (defaultCost > tileCost) {
+            (*gains)[s->first->Index] += defaultCost - tileCost;
+        }
+    }
     return cost;
 }
 
@@ -486,23 +2459,46 @@ void MISOSelector::buttomUp(context &ctx)
         std::list<IntriNode *>::iterator ti = node->TileList.begin(),
                                          te = node->TileList.end();
         for (; ti != te; ++ti) {
-            size_t cost = sumCost(*ti, ctx);
+            if (ctx.Enabled && !(*ti)->RefRPN.empty() &&
+                !ctx.Enabled->at((*ti)->Index)) {
+                continue;
+            }
+            size_t cost = sumCost(*ti, i, ctx);
+            AISE_STAT(Relaxations);
             if (cost < ctx.MinCost[i]) {
                 ctx.MinCost[i] = cost;
                 ctx.BestTile[i] = *ti;
+            } else if (cost == ctx.MinCost[i] &&
+                       !ctx.BestTile[i]->Outputs.empty() &&
+                       (*ti)->Outputs.empty()) {
+                // prefer single-output tiles on ties
+                ctx.BestTile[i] = *ti;
             }
         }
     }
 }
 
-size_t MISOSelector::sumCost(const IntriNode *tile, context &ctx)
+size_t MISOSelector::sumCost(const IntriNode *tile, size_t index,
+                             context &ctx)
 {
-    size_t cost = tile->Cost;
+    size_t cost = tile->Cost * ctx.WeightOf(firstOutput(tile, index));
     Node::const_node_iterator i = tile->PredBegin(), e = tile->PredEnd();
     for (; i != e; ++i) {
         cost += ctx.MinCost[(*i)->Index];
     }
-    return cost;
+
+    // Other outputs of the tile no longer need their own tiles. Outputs
+    // used inside the tile are skipped, since the tiles of this node pay
+    // for them anyway.
+    size_t saved = 0;
+    for (size_t i = 0, e = tile->Outputs.size(); i < e; i++) {
+        Node *output = tile->Outputs[i];
+        if (output->Index != index && !tile->UsedInside[i]) {
+            saved += ctx.BestTile[output->Index]->Cost *
+                     ctx.WeightOf(output->Index);
+        }
+    }
+    return cost > saved ? cost - saved : 0;
 }
 
 void MISOSelector::topDown(context &ctx)
@@ -511,7 +2507,9 @@ void MISOSelector::topDown(context &ctx)
     ctx.Matched.clear();
     ctx.Matched.resize(size, false);
 
-    std::queue<size_t> queue;
+    // Visit nodes in reversed topological order, so that other outputs of
+    // a multi-output tile are not matched before the tile.
+    std::priority_queue<size_t> queue;
     for (size_t i = 0; i < size; i++) {
         if (ctx.DAG[i]->Succ.empty()) {
             queue.push(i);
@@ -519,7 +2517,7 @@ void MISOSelector::topDown(context &ctx)
     }
 
     while (!queue.empty()) {
-        size_t index = queue.front();
+        size_t index = queue.top();
         queue.pop();
         if (ctx.Matched[index]) {
             continue;
@@ -527,6 +2525,12 @@ void MISOSelector::topDown(context &ctx)
         ctx.Matched[index] = true;
 
         IntriNode *tile = ctx.BestTile[index];
+        NodeArray::const_iterator o = tile->Outputs.begin(), oe;
+        for (oe = tile->Outputs.end(); o != oe; ++o) {
+            ctx.Matched[(*o)->Index] = true;
+            ctx.BestTile[(*o)->Index] = tile;
+        }
+
         Node::const_node_iterator i = tile->PredBegin(), e;
         for (e = tile->PredEnd(); i != e; ++i) {
             queue.push((*i)->Index);
@@ -536,10 +2540,163 @@ void MISOSelector::topDown(context &ctx)
 
 void MISOSynthesizer::AddInstr(const NodeArray *DAG)
 {
+    if (model == ShareModel) {
+        addShared(DAG);
+        return;
+    }
+
     NodeArray::const_iterator i = DAG->begin(), e = DAG->end();
     for (; i != e; ++i) {
         area += (*i)->TypeArea();
     }
 }
 
+MISOSynthesizer::source MISOSynthesizer::sourceOf(const Node *node)
+{
+    if (node->IsInput()) {
+        return source(inputSource, node->Type - Node::FirstInputTy);
+    }
+    if (node->IsConstant()) {
+        return source(constSource, constants[ConstNode::ValueOf(node)]);
+    }
+    return source(unitSource, node->Index);
+}
+
+size_t MISOSynthesizer::matchPorts(const unit &target,
+                                   const std::vector<source> &sources,
+                                   bool associative,
+                                   std::vector<size_t> &ports)
+{
+    size_t size = std::max(target.Ports.size(), sources.size());
+    std::vector<bool> taken(size, false);
+    ports.assign(sources.size(), size);
+
+    // Without a mux, a port should have the same source or no source.
+    for (size_t i = 0; i < sources.size(); i++) {
+        size_t begin = associative ? 0 : i, end = associative ? size : i + 1;
+        for (size_t p = begin; p < end; p++) {
+            if (!taken[p] && p < target.Ports.size() &&
+                target.Ports[p].count(sources[i])) {
+                ports[i] = p;
+                taken[p] = true;
+                break;
+            }
+        }
+    }
+
+    size_t muxes = 0;
+    for (size_t i = 0; i < sources.size(); i++) {
+        if (ports[i] != size) {
+            continue;
+        }
+        size_t p = i;
+        if (associative) {
+            for (p = 0; taken[p]; p++)
+                ;
+        }
+        ports[i] = p;
+        taken[p] = true;
+        if (p < target.Ports.size() && !target.Ports[p].empty()) {
+            muxes++;
+        }
+    }
+    return muxes;
+}
+
+size_t MISOSynthesizer::addSource(source_set &sources, source src)
+{
+    bool shared = !sources.empty();
+    if (sources.insert(src).second && shared) {
+        return Node::TypeArea(Node::SelectTy);
+    }
+    return 0;
+}
+
+void MISOSynthesizer::addShared(const NodeArray *DAG)
+{
+    // A mux is a select, and it's only worth sharing a unit if the muxes
+    // cost less than the unit.
+    size_t muxArea = Node::TypeArea(Node::SelectTy);
+    instrCount++;
+
+    NodeArray roots;
+    NodeArray::const_iterator i, e;
+    for (i = DAG->begin(), e = DAG->end(); i != e; ++i) {
+        Node *node = *i;
+
+        // Multi-output instruction ends with a virtual successor for each
+        // output.
+        if (node->TypeOf(Node::UnkTy)) {
+            roots.push_back(*node->PredBegin());
+            continue;
+        }
+        if (node->IsInput()) {
+            continue;
+        }
+        // Constants of the same value are shared.
+        if (node->IsConstant()) {
+            const std::string &value = ConstNode::ValueOf(node);
+            if (constants.find(value) == constants.end()) {
+                size_t index = constants.size();
+                constants[value] = index;
+                area += node->TypeArea();
+            }
+            continue;
+        }
+
+        std::vector<source> sources;
+        Node::const_node_iterator p = node->PredBegin(), pe = node->PredEnd();
+        for (; p != pe; ++p) {
+            sources.push_back(sourceOf(*p));
+        }
+
+        // find the unit of the same type that needs the fewest muxes
+        size_t best = units.size(), bestMuxes = 0;
+        std::vector<size_t> ports, bestPorts;
+        for (size_t u = 0, ue = units.size(); u < ue; u++) {
+            if (units[u].Type != node->Type ||
+                units[u].LastInstr == instrCount) {
+                continue;
+            }
+            size_t muxes = matchPorts(units[u], sources,
+                                      node->IsAssociative(), ports);
+            if (best == units.size() || muxes < bestMuxes) {
+                best = u;
+                bestMuxes = muxes;
+                bestPorts.swap(ports);
+            }
+        }
+        if (best == units.size() ||
+            (bestMuxes > 0 && bestMuxes * muxArea >= node->TypeArea())) {
+            best = units.size();
+            units.push_back(unit());
+            units[best].Type = node->Type;
+            area += node->TypeArea();
+            matchPorts(units[best], sources, false, bestPorts);
+        }
+
+        unit &target = units[best];
+        target.LastInstr = instrCount;
+        for (size_t s = 0; s < sources.size(); s++) {
+            if (bestPorts[s] >= target.Ports.size()) {
+                target.Ports.resize(bestPorts[s] + 1);
+            }
+            area += addSource(target.Ports[bestPorts[s]], sources[s]);
+        }
+        node->Index = best;
+    }
+
+    // Outputs of different units are selected by muxes before written
+    // back.
+    if (roots.empty()) {
+        roots.push_back(DAG->back());
+    }
+    if (outputs.size() < roots.size()) {
+        outputs.resize(roots.size());
+    }
+    for (size_t r = 0; r < roots.size(); r++) {
+        area += addSource(outputs[r], sourceOf(roots[r]));
+    }
+}
+
 } // namespace aise
@@ -2,36 +2,265 @@
 #define AISE_MISO_H
 
 #include "node.h"
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/StringMap.h"
 #include <vector>
 #include <map>
 #include <set>
-#include <queue>
 
 namespace aise
 {
 
+// MISOMatcher finds the cuts of a DAG that may be instructions of a
+// library, by matching the DAGs of the instructions top-down from each
+// node instead of enumerating every cut around it. Patterns are indexed by
+// the types of their roots and the heads of their operands, and subtrees
+// that patterns have in common are checked once for each node. They are
+// matched against the canonical form that MISOEnumerator gives to cuts:
+// - A subtraction or division is a sum or product whose last operand is
+//   inverted.
+// - Operands of an associative op may be ops of the same type merged into
+//   it, and are matched in any order.
+// Only single-output instructions are matched. A cut found is only a
+// candidate, whose constants, orders and shared nodes are checked by
+// canonicalizing it.
+class MISOMatcher
+{
+    typedef std::set<Node *, Node::LessIndexCompare> node_set;
+
+    // key is the heads of the operands of a root, see headOf, in order
+    // for non-associative ops and sorted for associative ones.
+    typedef std::vector<int> key;
+    // bucket indexes the patterns whose roots are of the same type by
+    // their keys.
+    struct bucket {
+        std::map<key, std::vector<size_t> > Patterns;
+        // max number of operands of the roots
+        size_t Arity;
+
+        bucket() : Arity(0) {}
+    };
+    std::map<Node::NodeType, bucket> roots;
+    std::vector<NodeArray> patterns;
+    // nodes used more than once in their patterns
+    std::set<const Node *> shared;
+    // numbers of the structures of subtrees in patterns, with inputs
+    // unnamed. Each pattern node keeps the number of its subtree in Index.
+    std::map<std::string, size_t> structures;
+
+    // binding is a partial match, which is copied where operands of an
+    // associative op may match in several ways.
+    struct binding {
+        // DAG nodes matched by pattern nodes
+        std::map<const Node *, Node *> Bound;
+        node_set Selected, Inputs;
+        // pairs of pattern and DAG nodes left to match
+        std::vector<std::pair<const Node *, Node *> > Goals;
+    };
+
+    // term is an operand of an associative op after merging, which may be
+    // inverted like the last operand of a subtraction.
+    struct term {
+        Node *Operand;
+        bool Inverted;
+    };
+    // flattening is a way to merge operands of an associative op.
+    struct flattening {
+        std::vector<term> Terms;
+        NodeArray Merged;
+    };
+
+    // assignment matches operands of an associative pattern to terms.
+    struct assignment {
+        // operands with inversions looked through, and their heads
+        std::vector<const Node *> Operands;
+        std::vector<int> Heads;
+        // Free tells if an operand is an input used once in the pattern,
+        // which may swap with other free operands without changing the
+        // cut.
+        std::vector<bool> Free;
+        std::vector<bool> Used;
+        std::vector<term> Terms;
+        std::vector<int> TermHeads;
+    };
+
+    // operands of each associative structure, by its number
+    std::vector<assignment> structureOperands;
+
+    struct query {
+        Node *Root;
+        size_t MaxDepth, ImmWidth;
+        // cuts found by the indexes of their nodes
+        std::map<std::vector<size_t>, NodeArray> *Cuts;
+        // results of feasible by structures and DAG nodes
+        llvm::DenseMap<std::pair<size_t, Node *>, bool> *Feasible;
+    };
+
+    // flatten lists the ways to merge operands of node into it, which are
+    // ops of type and used only by it, into at most limit terms.
+    static void flatten(Node *node, Node::NodeType type, size_t limit,
+                        std::vector<flattening> &options);
+
+    // prepare fills the operands of an associative pattern into a.
+    void prepare(const Node *pattern, assignment &a) const;
+    // setTerms moves terms into a for its operands to match.
+    static void setTerms(assignment &a, std::vector<term> &terms);
+
+    // feasible checks if the subtree of pattern may match node, ignoring
+    // which nodes are shared. Subtrees of the same structure are checked
+    // once for each node, since patterns have many in common.
+    bool feasible(const Node *pattern, Node *node, const query &q) const;
+
+    // compatible checks if the i-th operand of a may match Terms[pos].
+    bool compatible(const assignment &a, size_t i, size_t pos,
+                    const query &q) const;
+
+    // feasibleTerms checks if the operands of a may match its terms from
+    // Terms[pos] on in some order.
+    bool feasibleTerms(assignment &a, size_t pos, const query &q) const;
+
+    // lookup adds the patterns in b whose keys may match terms to
+    // candidates. Each term may be an input, so it's tried both ways.
+    static void lookup(const bucket &b, const std::vector<term> &terms,
+                       bool sorted, std::set<size_t> &candidates);
+
+    // search matches the goals of b, and adds each complete match to the
+    // cuts of q. b is changed.
+    void search(binding &b, const query &q) const;
+
+    // assign matches the operands of a to its terms from Terms[pos] on, in
+    // any order.
+    void assign(binding &b, assignment &a, size_t pos,
+                const query &q) const;
+
+    // accept adds the cut of a complete match if it's convex and within
+    // the max depth.
+    void accept(const binding &b, const query &q) const;
+
+  public:
+    ~MISOMatcher();
+
+    // AddPattern takes over the legalized DAG of a single-output
+    // instruction, and leaves DAG empty.
+    void AddPattern(NodeArray &DAG);
+
+    // Match adds the cuts of DAG that may match a pattern to cuts, in the
+    // order of their roots in DAG. Nodes of each cut are in reversed
+    // topological order, and none is deeper than maxDepth from the root
+    // inside the cut. Paths out of the cut may be longer, which
+    // MISOEnumerator checks against the upper cone of the root.
+    // Constants that fit in immWidth bits match immediates.
+    // Note: DAG should be legalized.
+    void Match(NodeArray *DAG, size_t maxDepth, size_t immWidth,
+               std::vector<NodeArray> &cuts) const;
+};
+
 class MISOEnumerator
 {
-    int maxInput, maxDepth;
+  public:
+    // Engine selects the search algorithm used by Enumerate.
+    enum Engine {
+        // AtasuEngine walks a binary tree over every node of the upper cone.
+        AtasuEngine,
+        // CutEngine only branches on nodes that keep the cut convex and
+        // prunes on inputs that can never be absorbed.
+        CutEngine,
+    };
+
+  private:
+    int maxInput, maxDepth, maxOutput;
+    Engine engine;
+    // width of immediates that constants are generalized to, 0 if not
+    size_t immWidth;
+    // max number of nodes in the upper cone of a root, 0 if unbounded
+    size_t window;
     // inst in minimal PRN
     llvm::StringMap<size_t> instrMap;
+    // instructions to match, see SetLibrary
+    const llvm::StringMap<IntriNode *> *library;
+    // matcher of library, see SetMatcher
+    const MISOMatcher *matcher;
+
+    // canon is the canonical form of a cut, found by canonicalize.
+    struct canon {
+        // minimal RefRPN, empty if the cut isn't an instruction
+        std::string RPN;
+        // instruction of library with RPN, NULL if none
+        const IntriNode *Instr;
+        Node *Root;
+        // Inputs, outputs and immediates in the order of RPN. They are only
+        // kept for tiles, and outputs only for multi-output cuts.
+        NodeArray Inputs, Outputs, Immediates;
+        std::vector<bool> UsedInside; // parallel to Outputs
+        size_t Permutations;          // RefRPNs written
+    };
+    // buffers of yield, kept between calls to save allocations
+    std::string rpn;
+    canon current;
+
+    // pipeline canonicalizes cuts on worker threads, see SetJobs.
+    class pipeline;
+    pipeline *pipe;
+    size_t jobs;
+
+    // directory of cached blocks, see SetCache
+    std::string cacheDir;
+    // number of blocks enumerated with the cache, and the last one where
+    // each instruction was found, by its index in instrMap
+    size_t blocks;
+    std::vector<size_t> lastBlock;
+    // instructions of the current block in the order they're first found
+    std::vector<std::string> blockInstrs;
 
     typedef std::set<Node *, Node::LessIndexCompare> node_set;
 
+    // reachability is computed once for each DAG by Enumerate, and shared
+    // by the contexts of all roots. Nodes are identified by Index.
+    struct reachability {
+        const NodeArray *DAG;
+        // Ancestors[i] holds the nodes that reach node i, and Descendants[i]
+        // the nodes that node i reaches. Neither holds node i itself.
+        std::vector<llvm::BitVector> Ancestors, Descendants;
+        // Depth holds the longest path from the current root to each node
+        // of its upper cone. It's filled by Context::Init and InitRegion,
+        // so that no root needs a map of its own.
+        std::vector<size_t> Depth;
+
+        explicit reachability(const NodeArray *_DAG);
+    };
+
     class Context
     {
-        typedef std::priority_queue<Node *, NodeArray, Node::LessIndexCompare> node_heap;
-
-        std::map<Node *, size_t> nodeDepth;
-
-        void pushAllPred(Node *root, node_heap &queue);
+        // change records how addCanon updated Canon, so that removeCanon
+        // can roll it back.
+        struct change {
+            Node *copy;
+            bool created;       // node had no copy before
+            NodeArray operands; // operands whose copies were created
+            size_t helpers;     // size of Helpers before
+            // copies that node was merged into, with their old operands
+            std::list<std::pair<Node *, std::list<Node *> > > merged;
+        };
+        std::vector<change> history;
+        // selected nodes in order of selection, which is reversed
+        // topological order. Canon is up to date with the first
+        // history.size() of them.
+        NodeArray order;
+
+        void addCanon(Node *node);
+        void removeCanon(Node *node);
+        // newCopy copies node for Canon.
+        Node *newCopy(const Node *node);
 
       public:
         // UpperCone is the MaxMISO rooted at root.
         // Nodes in UpperCone are in reversed topological order.
         NodeArray UpperCone;
-        node_set UpperConeSet;
+
+        // UpperCone and Selected by Index, for the checks in the loops of
+        // the engines.
+        llvm::BitVector UpperConeBits, SelectedBits;
 
         // parallel to UpperCone
         std::vector<bool> Choice;
@@ -39,26 +268,172 @@ class MISOEnumerator
         node_set Selected;
         node_set Input;
         // Number of inputs in Inputs that don't belong to UpperCone.
+        // CutEngine also counts inputs that have been excluded from the
+        // cut, since they can't be absorbed either.
         size_t MandatoryInputs;
 
-        Context() : MandatoryInputs(0) {}
-
-        // Init initializes context for root and its upper cone.
+        // Number of selected nodes used by nodes outside Selected.
+        size_t Outputs;
+
+        // For multi-output cuts, parallel to UpperCone.
+        // Candidate tells if the node may be selected. Tainted tells if an
+        // excluded node reaches Selected.
+        std::vector<bool> Candidate, Tainted;
+        std::map<Node *, size_t> Position;
+
+        // Canon maps selected and input nodes to their copies in the
+        // canonical form of the cut, with subtractions made associative
+        // and associative ops merged. Inputs are copied as UnkTy. It's
+        // updated one node at a time by UpdateCanon, so yield doesn't
+        // rebuild it for every cut.
+        std::map<Node *, Node *> Canon;
+        // Helpers holds inversions created for the copies.
+        NodeArray Helpers;
+
+        // Constants that fit in ImmWidth bits are copied as immediates.
+        size_t ImmWidth;
+
+        // Indexes of the nodes to select should be less than size.
+        explicit Context(size_t size)
+            : UpperConeBits(size), SelectedBits(size), MandatoryInputs(0),
+              Outputs(0), ImmWidth(0) {}
+
+        // Init initializes context for root and its upper cone, which
+        // holds at most window nodes if window isn't 0, see SetWindow.
         // Do call this method once for each instance of Context.
-        void Init(Node *root, size_t maxDepth);
+        void Init(Node *root, size_t maxDepth, size_t window,
+                  reachability &reach);
+
+        // InitRegion initializes context for multi-output cuts whose last
+        // node in topological order is root. UpperCone holds ancestors of
+        // root within maxDepth and nodes sharing operands with them, plus
+        // nodes on paths between them, which are never selected. Window
+        // bounds the ancestors and siblings together, but not the nodes on
+        // paths, which convexity needs.
+        // Do call this method once for each instance of Context.
+        void InitRegion(Node *root, size_t maxDepth, size_t window,
+                        reachability &reach);
+
+        // SelectCut selects the nodes of a cut, which are in reversed
+        // topological order, and their operands as inputs. It's for cuts
+        // found out of the engines. The root of the cut heads UpperCone,
+        // which is kept if Init has put it there.
+        void SelectCut(const NodeArray &cut);
+
+        // UnselectAll undoes all Selects and clears Input, so that the
+        // context may select another cut.
+        void UnselectAll();
+
+        // Select adds node to Selected.
+        // Nodes must be selected in reversed topological order.
+        void Select(Node *node);
+
+        // Unselect undoes the last Select, which must be of node.
+        void Unselect(Node *node);
+
+        // UpdateCanon brings Canon up to date with Selected, and returns
+        // copies of selected nodes in topological order. Most cuts are
+        // never yielded, so Select leaves the work to this method.
+        void UpdateCanon(NodeArray &copies);
 
         // IsOutput checks if node is used by nodes outside Selected.
         bool IsOutput(Node *node);
+
+        // IsTainted checks if node reaches Selected through excluded
+        // nodes. Only valid after InitRegion.
+        bool IsTainted(Node *node);
     };
 
     // recurse recurses on the current upper cone.
     void recurse(Context &ctx);
 
+    // expand extends the current cut with nodes after pos in UpperCone.
+    // Every selected node keeps the cut convex, so each call yields one
+    // distinct cut and the search is polynomial in the number of cuts.
+    void expand(Context &ctx, size_t pos);
+
     // yield yields the currently selected MISO instruction.
     void yield(Context &ctx);
 
+    // canonicalize finds the canonical form of the cut selected in ctx.
+    // rpn is a buffer. It doesn't change the enumerator, so that workers
+    // of pipeline may call it at the same time.
+    void canonicalize(Context &ctx, std::string &rpn, canon &c) const;
+
+    // record saves the instruction of c if it's new, or adds it to its
+    // root as a tile if it's in library.
+    void record(const canon &c);
+
+    // yieldCut yields a cut found by matcher, whose nodes are in reversed
+    // topological order, if it's in the upper cone of ctx, which is
+    // initialized for the root of cut.
+    void yieldCut(Context &ctx, const NodeArray &cut);
+
+    // search enumerates DAG with the engine or matcher.
+    void search(NodeArray *DAG);
+
+    // addInstr adds RPN to instrMap and to blockInstrs, unless they
+    // already have it. Returns true if it's new to instrMap.
+    bool addInstr(const std::string &RPN);
+
+    // cacheHeader returns the first line of the cache file of DAG, which
+    // holds a hash of its structure and the options that change the
+    // instructions found in it.
+    std::string cacheHeader(const NodeArray &DAG) const;
+
+    // loadBlock adds the instructions of the cache file at path, if it
+    // has header and is complete. Returns false if it doesn't.
+    bool loadBlock(const std::string &path, const std::string &header);
+
+    // saveBlock writes blockInstrs to the cache file at path.
+    void saveBlock(const std::string &path, const std::string &header);
+
   public:
-    MISOEnumerator(size_t _maxInput, size_t _maxDepth);
+    // Cuts with more than one output are only enumerated by CutEngine.
+    MISOEnumerator(size_t _maxInput, size_t _maxDepth,
+                   Engine _engine = AtasuEngine, size_t _maxOutput = 1);
+    ~MISOEnumerator();
+
+    // SetLibrary makes Enumerate match instructions in library instead of
+    // collecting new ones. Each match is added to its root as a tile,
+    // with the cost from library. Without a library no tile is kept, so
+    // memory doesn't grow with the number of cuts.
+    void SetLibrary(const llvm::StringMap<IntriNode *> *_library)
+    {
+        library = _library;
+    }
+
+    // SetImmediateWidth makes constants that fit in width bits immediates,
+    // see ConstNode::IsImmediate. 0 keeps constants as they are.
+    void SetImmediateWidth(size_t width) { immWidth = width; }
+
+    // SetMatcher makes Enumerate only try the cuts found by _matcher, which
+    // should hold the patterns of library. It's faster than enumerating
+    // all cuts when the library is small. Cuts out of the upper cone of
+    // their roots are dropped, so it finds the same tiles.
+    void SetMatcher(const MISOMatcher *_matcher) { matcher = _matcher; }
+
+    // SetWindow bounds the upper cone of each root to its first size
+    // nodes in reversed topological order, root included (default 0,
+    // unbounded). Each root then takes bounded time however large DAG is,
+    // which keeps unrolled blocks tractable. Cuts with a node beyond the
+    // window are lost; cones cut short are counted as pruned-window by
+    // -stats.
+    void SetWindow(size_t size) { window = size; }
+
+    // SetCache makes Enumerate keep the instructions of each DAG in a file
+    // of dir, named by a hash of the structure of the DAG and the options.
+    // A DAG enumerated before with the same options is read back instead,
+    // in the order it was enumerated, so Save gives the same result. dir
+    // should exist. The cache is only used without a library.
+    void SetCache(const std::string &dir) { cacheDir = dir; }
+
+    // SetJobs canonicalizes cuts on _jobs worker threads while the engine
+    // searches for more (default 1, in line). Cuts are still recorded in
+    // the order they are found, so instructions and tiles are the same.
+    // Threads that fail to start are left out, and cuts are canonicalized
+    // in line if none starts.
+    void SetJobs(size_t _jobs) { jobs = _jobs; }
 
     // Enumerate enumerates all MISO instructions in DAG.
     void Enumerate(NodeArray *DAG);
@@ -66,17 +441,31 @@ class MISOEnumerator
     void Save(llvm::raw_ostream &out);
 };
 
-// LegalizeDAG inserts ordering labels before non-associative ops, then
-// assignes indexes and builds successing relationship.
+// LegalizeDAG assignes indexes and builds successing relationship.
 // Nodes in DAG keep topological order after processing.
 void LegalizeDAG(NodeArray *DAG);
 
+// CriticalPathDelay returns the delay of the critical path from inputs of
+// an instruction to its roots, in the unit of Node::TypeCost.
+// - Associative ops are balanced into trees, combining the operands that
+//   are ready first.
+// - Additions and multiplications are chained through carry-save adders,
+//   so that only the last addition of a chain propagates carries.
+//   Divisions end a chain.
+// - Shifts by constants are wiring and take no time.
+// Note: DAG should be legalized and in topological order. Indexes of
+// nodes are changed.
+size_t CriticalPathDelay(const NodeArray &DAG, const NodeArray &roots);
+
 class MISOSelector
 {
     // each instruction is represented by an IntriNode
     llvm::StringMap<IntriNode *> instrMap;
     std::vector<IntriNode *> instrList;
-    size_t maxInput, maxDepth;
+    size_t maxInput, maxOutput, maxDepth, immWidth;
+    // patterns of single-output instructions, see SetEnumerate
+    MISOMatcher matcher;
+    bool enumerate;
 
     class context
     {
@@ -84,6 +473,17 @@ class MISOSelector
         typedef std::set<size_t> IndexSet;
 
         NodeArray DAG;
+        // weight of each node, NULL if all nodes weigh 1
+        const std::vector<size_t> *Weights;
+        // instructions that tiles may use by ID, NULL if all may be used
+        const std::vector<bool> *Enabled;
+
+        context() : Weights(NULL), Enabled(NULL) {}
+
+        size_t WeightOf(size_t index) const
+        {
+            return Weights ? Weights->at(index) : 1;
+        }
 
         // in the same order of nodes in DAG
         std::vector<IntriNode *> BestTile;
@@ -96,35 +496,183 @@ class MISOSelector
     void buttomUp(context &ctx);
 
     // sumCost returns the cost sum of the tile itself and its operands.
-    size_t sumCost(const IntriNode *tile, context &ctx);
+    // A multi-output tile is charged at the weight of its first output,
+    // where it's executed, and saves the tiles of its other outputs.
+    size_t sumCost(const IntriNode *tile, size_t index, context &ctx);
 
     // topDown traverses in reversed topological order to get a tiling of
-    // the DAG.
+    // the DAG. A multi-output tile also matches its other outputs.
     void topDown(context &ctx);
 
+    // solve selects DAG of ctx with the instructions enabled by ctx, and
+    // adds the gain of each one to gains if it's not NULL. Returns the
+    // static execution time.
+    size_t solve(context &ctx, std::vector<size_t> *gains);
+
+    // matchTiles adds tiles of configured instructions and the default
+    // tile, which is the last one, to each node of DAG, and assigns
+    // indexes.
+    void matchTiles(NodeArray *DAG);
+
   public:
-    MISOSelector() : maxInput(0) {}
+    // Site is a node where an instruction can be applied.
+    struct Site {
+        size_t Block; // number of DAGs profiled before
+        size_t Node;  // index in DAG
+        size_t Weight;
+        // Gain is the cost saved by applying the instruction at the node
+        // alone, with default tiles everywhere else.
+        size_t Gain;
+    };
 
+  private:
+    // sites of each instruction, parallel to instrList
+    std::vector<std::vector<Site> > sites;
+    size_t profiled;
+    // DAGs matched by Prepare, which keep all of their tiles
+    std::vector<context> prepared;
+    // prepared DAGs where each instruction has tiles, and the cost it
+    // saves there alone, as Profile counts
+    std::vector<std::vector<size_t> > blocks;
+    std::vector<size_t> bounds;
+
+  public:
+    // maxDepth should be the one used to enumerate the instructions.
+    MISOSelector(size_t _maxDepth = 10)
+        : maxInput(0), maxOutput(1), maxDepth(_maxDepth), immWidth(0),
+          enumerate(false), profiled(0) {}
+
+    // SetImmediateWidth should be the one used to enumerate the
+    // instructions, so that constants in DAG match the immediates.
+    void SetImmediateWidth(size_t width) { immWidth = width; }
+
+    // SetEnumerate makes tiles always found by enumerating all cuts of
+    // DAGs, as the instructions were. Otherwise a library of at most a few
+    // hundred single-output instructions is matched directly by
+    // MISOMatcher, which is faster for it.
+    void SetEnumerate(bool _enumerate) { enumerate = _enumerate; }
+
+    // AddInstr returns the ID of the instruction, which counts from 0 in
+    // the order of adding. Isomorphic instructions share the ID of the
+    // first one.
     // Note: DAG should be legalized.
-    void AddInstr(const NodeArray *DAG);
+    size_t AddInstr(const NodeArray *DAG);
 
     // Select maps DAG into configured instructions using dynamic
-    // programming. DAG should have been enumerated.
+    // programming.
     // Nodes in DAG will be assigned the correspoding tiles in their
-    // TileList. Skipped nodes have an empty TileList.
+    // TileList. Skipped nodes have an empty TileList. Other tiles are
+    // deleted.
+    // If weights is not NULL, cost of each tile is multiplied by the
+    // weight of its node, as for DAGs of traces.
     // Returns the static execution time of mapped DAG.
-    size_t Select(NodeArray *DAG);
+    size_t Select(NodeArray *DAG, const std::vector<size_t> *weights = NULL);
+
+    // Profile records the sites of each instruction in DAG for Prune.
+    // weights is the same as for Select. DAG is left with no tiles.
+    void Profile(NodeArray *DAG, const std::vector<size_t> *weights = NULL);
+
+    // Prune tells which instructions can be removed before selection by
+    // the sites profiled, in the order of IDs:
+    // - ID of the instruction itself, if it's kept;
+    // - -1, if it has no gain at any site;
+    // - ID of the instruction dominating it, which has at least the same
+    //   gain at each of its sites and no more area. Of instructions
+    //   dominating each other, the one with the least ID is kept.
+    // areas is in the order of IDs.
+    void Prune(const std::vector<size_t> &areas, std::vector<size_t> &result);
+
+    // Prepare matches DAG once for Solve. weights is the same as for
+    // Select. Tiles are kept in DAG, so both should be kept until the
+    // selector is destructed.
+    // Note: instructions should all be added before.
+    void Prepare(NodeArray *DAG, const std::vector<size_t> *weights = NULL);
+
+    // Solve selects the DAGs prepared with only the enabled instructions,
+    // and returns the sum of their static execution time.
+    // gains is the cost each instruction saves in the selection, against
+    // the default tiles of the nodes where it's selected.
+    size_t Solve(const std::vector<bool> &enabled, std::vector<size_t> &gains);
+
+    // SolveBlock selects the block-th DAG prepared like Solve.
+    size_t SolveBlock(size_t block, const std::vector<bool> &enabled);
+
+    // GetBlocks returns the prepared DAGs where an instruction has tiles.
+    const std::vector<size_t> &GetBlocks(size_t id) { return blocks[id]; }
+    // GetBound returns the sum of the cost an instruction saves at each of
+    // its tiles alone, which bounds the cost it saves with others.
+    size_t GetBound(size_t id) { return bounds[id]; }
+
+    const std::vector<Site> &GetSites(size_t id) { return sites[id]; }
+    const std::string &GetRefRPN(size_t id) { return instrList[id]->RefRPN; }
 
     size_t GetMaxInput() { return maxInput; }
+    size_t GetMaxOutput() { return maxOutput; }
 };
 
 class MISOSynthesizer
 {
+  public:
+    // Model selects how instructions are put into hardware.
+    enum Model {
+        // SumModel builds each instruction on its own datapath.
+        SumModel,
+        // ShareModel merges all instructions into one datapath, where
+        // operators of the same type are shared by adding muxes to their
+        // operands and outputs.
+        ShareModel,
+    };
+
+  private:
+    Model model;
     size_t area;
 
-  public:
-    MISOSynthesizer() : area(0) {}
+    // source identifies what drives a port of the datapath: a unit, an
+    // input of the instruction, or a constant.
+    enum sourceKind { unitSource, inputSource, constSource };
+    typedef std::pair<sourceKind, size_t> source;
+    typedef std::set<source> source_set;
+
+    // unit is an operator of the shared datapath.
+    struct unit {
+        Node::NodeType Type;
+        // sources of each operand
+        std::vector<source_set> Ports;
+        // last instruction using the unit, since each unit is used at
+        // most once by an instruction
+        size_t LastInstr;
+    };
+    std::vector<unit> units;
+    llvm::StringMap<size_t> constants;
+    // sources of each output
+    std::vector<source_set> outputs;
+    size_t instrCount;
+
+    // sourceOf returns the source of an operand. Units of operators are
+    // saved in Index.
+    source sourceOf(const Node *node);
 
+    // matchPorts assigns sources to ports of target, and returns the
+    // number of muxes to add. Operands of associative ops may take any
+    // port, preferring ports that already have the same source.
+    size_t matchPorts(const unit &target, const std::vector<source> &sources,
+                      bool associative, std::vector<size_t> &ports);
+
+    // addSource adds src to sources, and returns the area of the muxes
+    // added.
+    size_t addSource(source_set &sources, source src);
+
+    void addShared(const NodeArray *DAG);
+
+  public:
+    MISOSynthesizer(Model _model = ShareModel)
+        : model(_model), area(0), instrCount(0) {}
+
+    // AddInstr adds the area of instruction DAG to the datapath. It takes
+    // time linear in the size of DAG and the number of units, so that the
+    // area of a set of instructions is cheap enough to compute for each
+    // candidate set during selection.
+    // Note: DAG should be legalized. ShareModel changes indexes of nodes.
     void AddInstr(const NodeArray *DAG);
 
     size_t GetArea() { return area; }
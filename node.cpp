@@ -3,8 +3,10 @@
 #include "llvm/IR/Constant.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/InstrTypes.h"
-#include <sstream>
 #include <set>
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
 
 using namespace aise;
 using namespace llvm;
@@ -50,9 +52,6 @@ const char *Node::TypeName(NodeType type)
 
         NODE_TYPE_NAME(SelectTy, "?:");
 
-        NODE_TYPE_NAME(Order1Ty, "[1]");
-        NODE_TYPE_NAME(Order2Ty, "[2]");
-
     default:
         name = "$*";
     }
@@ -73,7 +72,7 @@ void Node::WriteTypeName(std::string &buffer) const
     default:
         if (Type >= FirstInputTy) {
             buffer.push_back('$');
-            buffer.append(ToString(Type - FirstInputTy + 1));
+            AppendInt(buffer, Type - FirstInputTy + 1);
         } else {
             buffer.append(TypeName());
         }
@@ -254,6 +253,14 @@ Node *Node::FromToken(const std::string &token, std::string &error)
         MATCH_TOKEN_TYPE("?:", SelectTy);
         break;
 
+    case 'i':
+        if (ParseInt(token.substr(1), value) < 0 || value < 1 || value > 64) {
+            error = "Invalid immediate width: ";
+            error.append(token);
+            return NULL;
+        }
+        return new ConstNode(token);
+
     case '$':
         if (ParseInt(token.substr(1), value) < 0) {
             error = "Invalid input index: ";
@@ -320,19 +327,6 @@ size_t Node::TypeCost(NodeType type)
     }
 }
 
-size_t Node::CriticalPathCost() const
-{
-    size_t maxCost = 0;
-    const_node_iterator i = PredBegin(), e = PredEnd();
-    for (; i != e; ++i) {
-        maxCost = std::max(maxCost, (*i)->Index);
-    }
-    if (IsAssociative()) {
-        return (Pred.size() - 1) * TypeCost(Type) + maxCost;
-    }
-    return TypeCost(Type) + maxCost;
-}
-
 size_t Node::TypeArea(NodeType type)
 {
     switch (type) {
@@ -376,42 +370,6 @@ void Node::PropagateSucc()
     case LtTy:   \
     case LeTy
 
-void Node::RelaxOrder(std::list<Node *> &buffer)
-{
-    switch (Type) {
-    // associative
-    CASE_ASSOCIATIVE : {
-        // count steps instead of using end() since Pred may increase
-        size_t size = Pred.size(), pos = 0;
-        for (node_iterator i = Pred.begin(); pos < size; ++pos) {
-            if (TypeOf(*i)) {
-                Pred.insert(Pred.end(), (*i)->PredBegin(), (*i)->PredEnd());
-                i = Pred.erase(i);
-            } else {
-                ++i;
-            }
-        }
-    } break;
-
-    case UnkTy:
-        break;
-
-    // non-commutative
-    default: {
-        node_iterator i = Pred.begin(), e = Pred.end();
-        for (unsigned cnt = 0; i != e && cnt < 3; ++cnt, ++i) {
-            // add ordering labels to operands since the second one
-            if (cnt > 0) {
-                Node *label = new Node((NodeType)(Order1Ty + cnt - 1));
-                label->AddPred(*i);
-                *i = label;
-                buffer.push_back(label);
-            }
-        }
-    } break;
-    }
-}
-
 void Node::ToAssociative(std::list<Node *> &buffer)
 {
     NodeType invType;
@@ -443,74 +401,135 @@ bool Node::LessIndexCompare::operator()(const Node *a, const Node *b) const
     return a->Index < b->Index;
 }
 
-bool Node::LessTypeCompare::operator()(const Node *a, const Node *b) const
+Node::TypeRank::~TypeRank()
+{
+    std::vector<const Node *>::iterator i = ranked.begin(), e = ranked.end();
+    for (; i != e; ++i) {
+        (*i)->rank = 0;
+    }
+}
+
+void Node::TypeRank::Merge(const Node *a, const Node *b)
+{
+    // A node already ranked keeps its class, since ranks only tell
+    // equality. Nodes in different classes may still be equal.
+    if (a->rank == 0 && b->rank == 0) {
+        a->rank = b->rank = ++classes;
+        ranked.push_back(a);
+        ranked.push_back(b);
+    } else if (a->rank == 0) {
+        a->rank = b->rank;
+        ranked.push_back(a);
+    } else if (b->rank == 0) {
+        b->rank = a->rank;
+        ranked.push_back(b);
+    }
+}
+
+int Node::LessTypeCompare::Compare(const Node *a, const Node *b) const
 {
     if (a == b) {
-        return false;
+        return 0;
     }
 
     if (a->TypeOf(b)) {
         if (a->IsConstant()) {
-            return ConstNode::ValueOf(a) < ConstNode::ValueOf(b);
+            return ConstNode::ValueOf(a).compare(ConstNode::ValueOf(b));
+        }
+        if (Rank && Rank->Equal(a, b)) {
+            return 0;
         }
 
         // compare recursively when two nodes have the same type
+        // Operands of non-associative ops are compared in order, so that
+        // each pair has the same position. With Rank, equal operands are
+        // only compared once.
         const_node_iterator ia = a->PredBegin(), ea = a->PredEnd();
         const_node_iterator ib = b->PredBegin(), eb = b->PredEnd();
         for (; ia != ea && ib != eb; ++ia, ++ib) {
-            if (operator()(*ia, *ib)) {
-                return true;
-            }
-            if (operator()(*ib, *ia)) {
-                return false;
+            int cmp = Compare(*ia, *ib);
+            if (cmp != 0) {
+                return cmp;
             }
-            // continue comparing if *ia and *ib are equal
         }
 
         // When all operands are equal, node with less operands are
         // considered smaller.
-        return a->Pred.size() < b->Pred.size();
+        int cmp = (int)a->Pred.size() - (int)b->Pred.size();
+        if (cmp == 0 && Rank) {
+            Rank->Merge(a, b);
+        }
+        return cmp;
     }
 
-    // lable is always bigger than any other types
-    if (a->IsLabel()) {
-        if (b->IsLabel()) {
-            return a->Type < b->Type;
+    return a->Type < b->Type ? -1 : 1;
+}
+
+void Node::Sort(TypeRank *rank)
+{
+    LessTypeCompare less(rank);
+
+    // Most nodes have no more than two operands. Sort them in place, since
+    // list::sort costs much more than one comparison.
+    if (Pred.size() < 2 || !IsAssociative()) {
+        return;
+    }
+    if (Pred.size() == 2) {
+        if (less(Pred.back(), Pred.front())) {
+            std::swap(Pred.front(), Pred.back());
         }
+        return;
+    }
+    Pred.sort(less);
+}
+
+bool Node::rpnBound::Exceeded(const std::string &buffer)
+{
+    if (RPN == NULL) {
         return false;
     }
-    if (b->IsLabel()) {
-        return true;
+    for (size_t size = buffer.size(); Checked < size; Checked++) {
+        if (Checked >= RPN->size()) {
+            return true;
+        }
+        char a = buffer[Checked], b = (*RPN)[Checked];
+        if (a != b) {
+            if ((unsigned char)a > (unsigned char)b) {
+                return true;
+            }
+            RPN = NULL;
+            return false;
+        }
     }
-
-    return a->Type < b->Type;
+    return false;
 }
 
-void Node::Sort() { Pred.sort(LessTypeCompare()); }
-
-size_t Node::writeRefRPNImpl(std::string &buffer, size_t index)
+size_t Node::writeRefRPNImpl(std::string &buffer, size_t index,
+                             rpnBound *bound)
 {
     if (Index > 0) {
         buffer.push_back('@');
-        std::stringstream buf;
-        buf << Index;
-        buffer.append(buf.str());
+        AppendInt(buffer, Index);
+        if (bound && bound->Exceeded(buffer)) {
+            return 0;
+        }
         return index + 1;
     }
 
     if (TypeOf(ConstTy)) {
         buffer.append(ConstNode::ValueOf(this));
+        if (bound && bound->Exceeded(buffer)) {
+            return 0;
+        }
         Index = index;
         return index + 1;
     }
-    if (TypeOf(Order1Ty) || TypeOf(Order2Ty)) {
-        // label node doesn't take up space
-        return (*PredBegin())->writeRefRPNImpl(buffer, index);
-    }
-
     node_iterator i = Pred.begin(), e = Pred.end();
     for (; i != e; ++i) {
-        index = (*i)->writeRefRPNImpl(buffer, index);
+        index = (*i)->writeRefRPNImpl(buffer, index, bound);
+        if (index == 0) {
+            return 0;
+        }
         buffer.push_back(' ');
     }
     WriteTypeName(buffer);
@@ -519,17 +538,63 @@ size_t Node::writeRefRPNImpl(std::string &buffer, size_t index)
     // add a number to associative ops with more than 2 operands
     CASE_ASSOCIATIVE:
         if (Pred.size() > 2) {
-            std::stringstream buf;
-            buf << Pred.size();
-            buffer.append(buf.str());
+            AppendInt(buffer, Pred.size());
         }
         break;
     }
+    if (bound && bound->Exceeded(buffer)) {
+        return 0;
+    }
 
     Index = index;
     return index + 1;
 }
 
+bool Node::WriteRefRPN(const NodeArray &roots, std::string &buffer,
+                       const std::string *bound)
+{
+    rpnBound rpn(bound);
+    size_t index = 1;
+    NodeArray::const_iterator i = roots.begin(), e = roots.end();
+    for (; i != e; ++i) {
+        if (i != roots.begin()) {
+            buffer.push_back(' ');
+        }
+        index = (*i)->writeRefRPNImpl(buffer, index, bound ? &rpn : NULL);
+        if (index == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool ConstNode::Generalize(Node *node, size_t width)
+{
+    std::string &value = ValueOf(node);
+    if (width == 0 || value.empty() || value[0] == 'i') {
+        return false;
+    }
+
+    // two's complement if negative, and unsigned otherwise
+    const char *begin = value.c_str();
+    char *end;
+    errno = 0;
+    long long number = strtoll(begin, &end, 10);
+    if (errno != 0 || *end != '\0' || end == begin) {
+        return false;
+    }
+    if (width < 64) {
+        long long limit = 1LL << (width - 1);
+        if (number < -limit || number >= limit * 2) {
+            return false;
+        }
+    }
+
+    value = "i";
+    AppendInt(value, width);
+    return true;
+}
+
 IntriNode *IntriNode::TileOfNode(Node *node)
 {
     IntriNode *tile = new IntriNode();
@@ -53,21 +53,24 @@ class Node
         // Trinary op
         SelectTy,
 
-        // Ordering labels
-        // Note: there is no Order0Ty since order 0 doesn't need a label.
-        Order1Ty,
-        Order2Ty,
-
         // Input variables
         FirstInputTy,
     };
 
     NodeType Type;
+    // Operands of associative ops are unordered. Operands of the other ops
+    // are ordered by their positions in Pred, which is kept by Sort and
+    // compared position by position, so order needs no node of its own.
     std::list<Node *> Pred, Succ;
     size_t Index;
 
-    Node() : Type(UnkTy) {}
-    Node(NodeType type) : Type(type) {}
+  private:
+    // class in the current TypeRank, 0 if not ranked
+    mutable size_t rank;
+
+  public:
+    Node() : Type(UnkTy), rank(0) {}
+    Node(NodeType type) : Type(type), rank(0) {}
 
     static const char *TypeName(NodeType type);
     const char *TypeName() const { return TypeName(Type); }
@@ -76,11 +79,12 @@ class Node
     bool TypeOf(const Node *target) const { return target->Type == Type; }
     bool TypeOf(NodeType _type) const { return _type == Type; }
 
-    bool IsLabel() const { return TypeOf(Order1Ty) || TypeOf(Order2Ty); }
     bool IsConstant() const { return TypeOf(ConstTy); }
     bool IsIntrinsic() const { return TypeOf(IntriTy); }
     bool IsAssociative() const;
     bool IsInput() const { return Type >= FirstInputTy; }
+    // IsOp checks if the node is an op computed from its operands.
+    bool IsOp() const { return Type > IntriTy && Type < FirstInputTy; }
 
     static Node *FromInstruction(const llvm::Instruction *inst);
     static Node *FromValue(const llvm::Value *val);
@@ -101,13 +105,16 @@ class Node
         return (cost + UnitCost - 1) / UnitCost * UnitCost;
     }
 
+    // OutputCost is the cost of writing back each extra output of a
+    // multi-output instruction through the only write port.
+    static const size_t OutputCost = UnitCost;
+
+    // CarrySaveCost is the cost of a carry-save adder, which adds three
+    // numbers into two without propagating carries.
+    static const size_t CarrySaveCost = 20;
+
     // TypeCost returns the base cost of this type.
     static size_t TypeCost(NodeType type);
-    // CriticalPathCost returns the cost sum of this node and the operand
-    // in the critical path. It considers impact of association.
-    // This method requires that the costs of its operands are already
-    // computed and saved in Index.
-    size_t CriticalPathCost() const;
 
     static size_t TypeArea(NodeType type);
     size_t TypeArea() { return TypeArea(Type); }
@@ -133,8 +140,40 @@ class Node
         bool operator()(const Node *a, const Node *b) const;
     };
 
+    // TypeRank remembers nodes found equal under LessTypeCompare by
+    // giving them the same rank, so that comparing them again takes O(1)
+    // instead of recursing into shared operands. Ranks are reset when
+    // TypeRank is destructed. Don't change ranked nodes in the meantime.
+    class TypeRank
+    {
+        std::vector<const Node *> ranked;
+        size_t classes;
+
+      public:
+        TypeRank() : classes(0) {}
+        ~TypeRank();
+
+        // Equal tells if a and b are known to be equal.
+        bool Equal(const Node *a, const Node *b) const
+        {
+            return a->rank > 0 && a->rank == b->rank;
+        }
+        // Merge records that a and b are equal.
+        void Merge(const Node *a, const Node *b);
+    };
+    friend class TypeRank;
+
     struct LessTypeCompare {
-        bool operator()(const Node *a, const Node *b) const;
+        TypeRank *Rank;
+
+        LessTypeCompare(TypeRank *_rank = NULL) : Rank(_rank) {}
+        bool operator()(const Node *a, const Node *b) const
+        {
+            return Compare(a, b) < 0;
+        }
+        // Compare returns a negative value if a is less than b, 0 if they
+        // are equal, and a positive value otherwise.
+        int Compare(const Node *a, const Node *b) const;
     };
 
     // ToAssociative transforms the op to it's associative-equivalent form.
@@ -142,25 +181,46 @@ class Node
     // Note: call this method after the node is completed.
     void ToAssociative(std::list<Node *> &buffer);
 
-    // RelaxOrder merges operands of associative ops (+, *, &, |, ^), and
-    // adds order labels to non-commutative ops (-, /, %, shift, ?:, cmp).
-    // Merged operands are excluded from the current node. For convenience
-    // of memory management, new labels are added to buffer.
-    // Note: this method is not recursive. Call it in topological order.
-    void RelaxOrder(std::list<Node *> &buffer);
-
-    // Sort sorts the operands of the current node (not recursive).
-    // It's required that the predecessors are all sorted.
-    void Sort();
+    // Sort sorts the operands of the current node if it's associative (not
+    // recursive). It's required that the predecessors are all sorted. Pass
+    // the same rank to all nodes sorted in one pass to share the
+    // comparisons.
+    void Sort(TypeRank *rank = NULL);
 
     // WriteRefRPN writes the referenced Reversed Polish notation of the
     // upper cone of this node.
     // This method requires that indexes of all the nodes in the upper cone
     // be set to 0, and will change these indexes during processing.
-    void WriteRefRPN(std::string &buffer) { writeRefRPNImpl(buffer, 1); }
+    void WriteRefRPN(std::string &buffer) { writeRefRPNImpl(buffer, 1, NULL); }
+
+    // WriteRefRPN writes the upper cones of several outputs one after
+    // another. Later outputs may reference nodes of former ones, and the
+    // outputs are left on the stack in order.
+    static void WriteRefRPN(const NodeArray &roots, std::string &buffer)
+    {
+        WriteRefRPN(roots, buffer, NULL);
+    }
+
+    // WriteRefRPN with a bound stops as soon as what's written is greater
+    // than bound, and returns false, leaving buffer incomplete. Nothing is
+    // allocated if buffer has enough capacity. NULL bound means no bound.
+    static bool WriteRefRPN(const NodeArray &roots, std::string &buffer,
+                            const std::string *bound);
 
   private:
-    size_t writeRefRPNImpl(std::string &buffer, size_t index);
+    // rpnBound compares buffer with RPN as it's being written.
+    struct rpnBound {
+        const std::string *RPN; // NULL once buffer is known to be less
+        size_t Checked;         // length of buffer known to equal RPN
+
+        rpnBound(const std::string *rpn) : RPN(rpn), Checked(0) {}
+        // Exceeded checks if buffer is already greater than RPN.
+        bool Exceeded(const std::string &buffer);
+    };
+
+    // writeRefRPNImpl returns the next index, or 0 if it exceeds bound.
+    size_t writeRefRPNImpl(std::string &buffer, size_t index,
+                           rpnBound *bound);
 
   public:
     std::list<IntriNode *> TileList;
@@ -188,6 +248,18 @@ class ConstNode : public Node
 
     ConstNode() : Node(ConstTy) {}
     ConstNode(const std::string &value) : Node(ConstTy), Value(value) {}
+
+    // An immediate is an operand taken from the instruction encoding, so
+    // that instructions differing in constants can be one instruction.
+    // It's written as "i" followed by its width in bits, like "i8".
+    static bool IsImmediate(const Node *node)
+    {
+        return node->IsConstant() && ValueOf(node)[0] == 'i';
+    }
+
+    // Generalize replaces the value of node with an immediate of width
+    // bits if it's an integer that fits in. Returns false if it doesn't.
+    static bool Generalize(Node *node, size_t width);
 };
 
 class IntriNode : public Node
@@ -195,6 +267,15 @@ class IntriNode : public Node
   public:
     std::string RefRPN; // empty for default tile
     size_t Cost;
+    // Outputs are the nodes defined by a multi-output tile, in the order
+    // of RefRPN. It's empty for single-output tiles.
+    NodeArray Outputs;
+    // UsedInside tells if an output is also an operand in the tile.
+    // Parallel to Outputs.
+    std::vector<bool> UsedInside;
+    // Immediates are the constants of a tile taken as immediates, in the
+    // order of RefRPN.
+    NodeArray Immediates;
 
     IntriNode() : Node(IntriTy), Cost(0) {}
 
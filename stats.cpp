@@ -0,0 +1,61 @@
+#include "stats.h"
+#include "llvm/Support/Format.h"
+
+using namespace llvm;
+
+namespace
+{
+
+const char *counterNames[] = {
+    "recurse-calls",
+    "expand-calls",
+    "pruned-output",
+    "pruned-input",
+    "pruned-depth",
+    "pruned-window",
+    "yields",
+    "permutations",
+    "canon-hits",
+    "canon-misses",
+    "tiles-kept",
+    "tiles-filtered",
+    "relaxations",
+    "cache-hits",
+    "cache-misses",
+};
+
+const char *timerNames[] = {
+    "parse",
+    "legalize",
+    "enumerate",
+    "canonicalize",
+    "select",
+    "area",
+};
+
+} // namespace
+
+namespace aise
+{
+
+size_t Stats::Counters[Stats::NumCounters];
+std::clock_t Stats::Timers[Stats::NumTimers];
+bool Stats::Enabled = false;
+
+void Stats::Print(raw_ostream &out)
+{
+#ifdef AISE_NO_STATS
+    out << "stats: Disabled at compile time\n";
+#else
+    for (int i = 0; i < NumCounters; i++) {
+        out << counterNames[i] << ": " << Counters[i] << '\n';
+    }
+    for (int i = 0; i < NumTimers; i++) {
+        double seconds = (double)Timers[i] / CLOCKS_PER_SEC;
+        out << "time-" << timerNames[i] << ": "
+            << format("%.3f", seconds) << '\n';
+    }
+#endif
+}
+
+} // namespace aise
@@ -0,0 +1,91 @@
+#ifndef AISE_STATS_H
+#define AISE_STATS_H
+
+#include "llvm/Support/raw_ostream.h"
+#include <ctime>
+
+namespace aise
+{
+
+// Stats collects counters and phase timers of the hot paths. They are
+// reported by -stats, and compiled out with -DAISE_NO_STATS (make STATS=0).
+class Stats
+{
+  public:
+    enum Counter {
+        RecurseCalls,  // calls of recurse (atasu engine)
+        ExpandCalls,   // calls of expand (cut engine)
+        PrunedOutput,  // nodes not selected for being outputs
+        PrunedInput,   // nodes not selected for exceeding max input
+        PrunedDepth,   // nodes left out of upper cones by max depth
+        PrunedWindow,  // upper cones cut short by the window
+        Yields,        // cuts passed to yield
+        Permutations,  // RefRPNs written for permutations of a cut
+        CanonHits,     // canonical forms found before
+        CanonMisses,   // canonical forms found for the first time
+        TilesKept,     // matches of library instructions
+        TilesFiltered, // cuts that match no library instruction
+        Relaxations,   // tiles tried by the dynamic programming
+        CacheHits,     // blocks read from the cache of enum
+        CacheMisses,   // blocks enumerated and written to the cache
+        NumCounters,
+    };
+
+    // Phases may nest: legalize runs inside parse, and canonicalize
+    // inside enumerate. Canonicalize only counts cuts canonicalized in
+    // line, since clock() counts the CPU time of all threads.
+    enum Timer {
+        ParseTimer,
+        LegalizeTimer,
+        EnumerateTimer,
+        CanonicalizeTimer,
+        SelectTimer,
+        AreaTimer,
+        NumTimers,
+    };
+
+    static size_t Counters[NumCounters];
+    // CPU time of each phase in clock ticks
+    static std::clock_t Timers[NumTimers];
+    // Timers only run if Enabled, since reading the clock isn't free.
+    static bool Enabled;
+
+    static void Print(llvm::raw_ostream &out);
+};
+
+// ScopedTimer adds the CPU time of its scope to a timer.
+class ScopedTimer
+{
+    Stats::Timer timer;
+    std::clock_t start;
+
+  public:
+    ScopedTimer(Stats::Timer _timer) : timer(_timer)
+    {
+        start = Stats::Enabled ? std::clock() : 0;
+    }
+
+    ~ScopedTimer()
+    {
+        if (Stats::Enabled) {
+            Stats::Timers[timer] += std::clock() - start;
+        }
+    }
+};
+
+} // namespace aise
+
+#ifdef AISE_NO_STATS
+#define AISE_STAT(counter) ((void)0)
+#define AISE_STAT_ADD(counter, n) ((void)0)
+#define AISE_TIMER(timer) ((void)0)
+#else
+#define AISE_STAT(counter) (++aise::Stats::Counters[aise::Stats::counter])
+#define AISE_STAT_ADD(counter, n) \
+    (aise::Stats::Counters[aise::Stats::counter] += (n))
+// Only one timer can be started in a scope.
+#define AISE_TIMER(timer) \
+    aise::ScopedTimer scopedTimer(aise::Stats::timer)
+#endif
+
+#endif
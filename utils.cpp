@@ -1,9 +1,12 @@
 #include "utils.h"
 #include "miso.h"
+#include "stats.h"
 #include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
 #include "llvm/Bitcode/ReaderWriter.h"
 #include "llvm/IR/Constant.h"
 #include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
 #include "llvm/Support/CommandLine.h"
@@ -11,6 +14,7 @@
 #include "llvm/Support/raw_os_ostream.h"
 #include "llvm/Support/system_error.h"
 #include <queue>
+#include <set>
 #include <sstream>
 #include <fstream>
 
@@ -21,92 +25,258 @@ namespace
 {
 
 typedef DenseMap<Value const *, Node *> value_node_map;
+typedef std::vector<const BasicBlock *> block_array;
+typedef std::set<const BasicBlock *> block_set;
 
-NodeArray *parseBasicBlock(const BasicBlock &bb)
+// isUsedOutsideOfTrace works like Instruction::isUsedOutsideOfBlock,
+// except that all blocks of the trace are taken as inside.
+bool isUsedOutsideOfTrace(const Instruction &inst, const block_set &blocks)
 {
-    NodeArray *DAGPtr = new NodeArray(), &DAG = *DAGPtr;
-    value_node_map nodeMap;
-
-    BasicBlock::const_iterator instIter = bb.begin(), instEnd = bb.end();
-    for (; instIter != instEnd; ++instIter) {
-        const Instruction &inst = *instIter;
-        Node *node = Node::FromInstruction(&inst);
-
-        // add operands to node
-        User::const_op_iterator opIter = inst.op_begin(), opEnd = inst.op_end();
-        for (; opIter != opEnd; ++opIter) {
-            value_node_map::iterator opNode = nodeMap.find(*opIter);
-
-            // When the operand is defined in another basic block, or is
-            // defined later in the same block but used by a phi instruction,
-            // it would not be found.
-            if (opNode == nodeMap.end()) {
-                Node *virtIn = Node::FromValue(*opIter);
-                virtIn->Index = DAG.size();
-                node->AddPred(virtIn);
-                DAG.push_back(virtIn);
-                nodeMap[*opIter] = virtIn;
-            } else {
-                node->AddPred(opNode->second);
+    Value::const_use_iterator i = inst.use_begin(), e = inst.use_end();
+    for (; i != e; ++i) {
+        const Instruction *user = cast<Instruction>(*i);
+        const PHINode *phi = dyn_cast<PHINode>(user);
+        if (!phi) {
+            if (blocks.find(user->getParent()) == blocks.end()) {
+                return true;
             }
+        } else if (blocks.find(phi->getIncomingBlock(i.getUse())) ==
+                   blocks.end()) {
+            return true;
         }
+    }
+    return false;
+}
 
-        // look for external uses of node
-        Node *virtSucc = NULL;
-        if (inst.isUsedOutsideOfBlock(&bb)) {
-            virtSucc = new Node();
-        } else {
-            Value::const_use_iterator useIter = inst.use_begin(),
-                                      useEnd = inst.use_end();
-            for (; useIter != useEnd; ++useIter) {
-                // used by previous phi in the same block
-                if (nodeMap.find(*useIter) != nodeMap.end()) {
-                    virtSucc = new Node();
-                    break;
-                }
+// DAGBuilder appends nodes to a DAG, keeping their indexes and the
+// weights of the blocks they come from.
+class DAGBuilder
+{
+  public:
+    NodeArray *DAG;
+    std::vector<size_t> *Weights; // may be NULL
+    size_t Weight;                // weight of the current block
+    value_node_map NodeMap;
+    NodeValueMap *Values; // may be NULL
+
+    DAGBuilder(std::vector<size_t> *weights, NodeValueMap *values)
+        : DAG(new NodeArray()), Weights(weights), Weight(1), Values(values) {}
+
+    // Bind records val as the value of node. The module is only parsed
+    // as const, but it's rewritten by the values later.
+    void Bind(Node *node, const Value *val)
+    {
+        NodeMap[val] = node;
+        if (Values) {
+            (*Values)[node] = const_cast<Value *>(val);
+        }
+    }
+
+    void Push(Node *node)
+    {
+        node->Index = DAG->size();
+        DAG->push_back(node);
+        if (Weights) {
+            Weights->push_back(Weight);
+        }
+    }
+
+    // Lookup returns the node of val. When val is defined in another
+    // basic block, or is defined later in the same block but used by a
+    // phi instruction, a virtual input is created for it.
+    Node *Lookup(const Value *val)
+    {
+        value_node_map::iterator i = NodeMap.find(val);
+        if (i != NodeMap.end()) {
+            return i->second;
+        }
+        Node *virtIn = Node::FromValue(val);
+        Push(virtIn);
+        Bind(virtIn, val);
+        return virtIn;
+    }
+
+    // IsUsedExternally checks if inst is used outside of blocks, or by
+    // a previous phi.
+    bool IsUsedExternally(const Instruction &inst, const block_set &blocks)
+    {
+        if (isUsedOutsideOfTrace(inst, blocks)) {
+            return true;
+        }
+        Value::const_use_iterator i = inst.use_begin(), e = inst.use_end();
+        for (; i != e; ++i) {
+            if (NodeMap.find(*i) != NodeMap.end()) {
+                return true;
             }
         }
+        return false;
+    }
+};
+
+// parseTrace parses blocks of a trace as one DAG. Each block except the
+// first should have the previous one as its only predecessor. If weights
+// is not NULL, weights of the blocks are read from blockWeights and saved
+// for each node, parallel to DAG. If values is not NULL, values of nodes
+// are saved in it.
+NodeArray *parseTrace(const block_array &trace,
+                      const std::vector<size_t> &blockWeights,
+                      std::vector<size_t> *weights, NodeValueMap *values)
+{
+    DAGBuilder builder(weights, values);
+    block_set blocks(trace.begin(), trace.end());
 
-        // add node to DAG
-        node->Index = DAG.size();
-        nodeMap[&inst] = node;
-        DAG.push_back(node);
-        if (virtSucc) {
-            virtSucc->Index = DAG.size();
-            virtSucc->AddPred(node);
-            DAG.push_back(virtSucc);
+    for (size_t b = 0, be = trace.size(); b < be; b++) {
+        const BasicBlock &bb = *trace[b];
+        if (b < blockWeights.size()) {
+            builder.Weight = blockWeights[b];
+        }
+
+        BasicBlock::const_iterator instIter = bb.begin(), instEnd = bb.end();
+        for (; instIter != instEnd; ++instIter) {
+            const Instruction &inst = *instIter;
+
+            // A phi in a later block has only one incoming value, which
+            // comes from the previous block. Take it as that value.
+            if (b > 0 && PHINode::classof(&inst)) {
+                Node *node = builder.Lookup(inst.getOperand(0));
+                if (builder.IsUsedExternally(inst, blocks)) {
+                    Node *virtSucc = new Node();
+                    virtSucc->AddPred(node);
+                    builder.Push(virtSucc);
+                }
+                builder.NodeMap[&inst] = node;
+                continue;
+            }
+
+            // add operands to node
+            Node *node = Node::FromInstruction(&inst);
+            User::const_op_iterator opIter = inst.op_begin(),
+                                    opEnd = inst.op_end();
+            for (; opIter != opEnd; ++opIter) {
+                node->AddPred(builder.Lookup(*opIter));
+            }
+
+            // look for external uses of node
+            Node *virtSucc = NULL;
+            if (builder.IsUsedExternally(inst, blocks)) {
+                virtSucc = new Node();
+            }
+
+            // add node to DAG
+            builder.Bind(node, &inst);
+            builder.Push(node);
+            if (virtSucc) {
+                virtSucc->AddPred(node);
+                builder.Push(virtSucc);
+            }
         }
     }
 
     // build successing relationship
     {
-        std::vector<Node *>::iterator i = DAG.begin(), e = DAG.end();
+        std::vector<Node *>::iterator i = builder.DAG->begin(),
+                                      e = builder.DAG->end();
         for (; i != e; ++i) {
             (*i)->PropagateSucc();
         }
     }
 
-    return DAGPtr;
+    return builder.DAG;
 }
 
-} // namespace
+NodeArray *parseBasicBlock(const BasicBlock &bb, NodeValueMap *values)
+{
+    return parseTrace(block_array(1, &bb), std::vector<size_t>(), NULL,
+                      values);
+}
 
-namespace aise
+// formTraces groups blocks of func into traces. Starting from the hottest
+// block left, a trace grows to the hottest successor that is left and has
+// no other predecessor, so that it can only be entered from its head.
+// Weights of blocks are read from weights, which is advanced past them.
+void formTraces(const Function &func, std::list<size_t>::const_iterator &weights,
+                std::list<block_array> &traces,
+                std::list<std::vector<size_t> > &traceWeights)
 {
+    block_array blocks;
+    std::vector<size_t> blockWeights;
+    DenseMap<const BasicBlock *, size_t> blockIndex;
+    Function::const_iterator bbIter = func.getBasicBlockList().begin(),
+                             bbEnd = func.getBasicBlockList().end();
+    for (; bbIter != bbEnd; ++bbIter, ++weights) {
+        blockIndex[&*bbIter] = blocks.size();
+        blocks.push_back(&*bbIter);
+        blockWeights.push_back(*weights);
+    }
 
-int ParseBitcode(Twine path, std::list<NodeArray *> &buffer)
+    std::vector<bool> done(blocks.size(), false);
+    for (size_t left = blocks.size(); left > 0;) {
+        size_t head = blocks.size();
+        for (size_t i = 0, e = blocks.size(); i < e; i++) {
+            if (!done[i] &&
+                (head == blocks.size() || blockWeights[i] > blockWeights[head])) {
+                head = i;
+            }
+        }
+
+        block_array trace;
+        std::vector<size_t> weightList;
+        for (size_t cur = head; cur != blocks.size();) {
+            trace.push_back(blocks[cur]);
+            weightList.push_back(blockWeights[cur]);
+            done[cur] = true;
+            left--;
+
+            const TerminatorInst *term = blocks[cur]->getTerminator();
+            size_t next = blocks.size();
+            for (unsigned i = 0, e = term->getNumSuccessors(); i < e; i++) {
+                const BasicBlock *succ = term->getSuccessor(i);
+                size_t index = blockIndex[succ];
+                if (done[index] || succ->getSinglePredecessor() != blocks[cur]) {
+                    continue;
+                }
+                if (next == blocks.size() ||
+                    blockWeights[index] > blockWeights[next]) {
+                    next = index;
+                }
+            }
+            cur = next;
+        }
+
+        traces.push_back(trace);
+        traceWeights.push_back(weightList);
+    }
+}
+
+Module *parseModule(Twine path)
 {
     OwningPtr<MemoryBuffer> bitcodeBuffer;
     error_code getFileErr = MemoryBuffer::getFile(path, bitcodeBuffer);
     if (getFileErr != error_code::success()) {
         errs() << path << ": " << getFileErr.message() << '\n';
-        return -1;
+        return NULL;
     }
 
     std::string parseBitcodeErr;
     Module *mod = ParseBitcodeFile(bitcodeBuffer.get(), getGlobalContext(), &parseBitcodeErr);
     if (!mod) {
         errs() << path << ": " << parseBitcodeErr << '\n';
+        return NULL;
+    }
+    return mod;
+}
+
+} // namespace
+
+namespace aise
+{
+
+int ParseBitcode(Twine path, std::list<NodeArray *> &buffer,
+                 Module **module, NodeValueMap *values)
+{
+    AISE_TIMER(ParseTimer);
+    Module *mod = parseModule(path);
+    if (!mod) {
         return -1;
     }
 
@@ -120,18 +290,85 @@ int ParseBitcode(Twine path, std::list<NodeArray *> &buffer)
         Function::const_iterator bbIter = funcIter->getBasicBlockList().begin(),
                                  bbEnd = funcIter->getBasicBlockList().end();
         for (; bbIter != bbEnd; ++bbIter, ++bbCount) {
-            buffer.push_back(parseBasicBlock(*bbIter));
+            buffer.push_back(parseBasicBlock(*bbIter, values));
         }
     }
+
+    if (module) {
+        *module = mod;
+    } else {
+        delete mod;
+    }
     return bbCount;
 }
 
+int ParseTraces(Twine path, const std::list<size_t> &weights,
+                std::list<NodeArray *> &buffer,
+                std::list<std::vector<size_t> > &nodeWeights,
+                Module **module, NodeValueMap *values)
+{
+    AISE_TIMER(ParseTimer);
+    Module *mod = parseModule(path);
+    if (!mod) {
+        return -1;
+    }
+
+    // all blocks weigh 1 without weights
+    std::list<size_t> defaultWeights;
+    const std::list<size_t> *blockWeights = &weights;
+    size_t bbCount = 0;
+    Module::const_iterator funcIter, funcEnd = mod->getFunctionList().end();
+    for (funcIter = mod->getFunctionList().begin(); funcIter != funcEnd;
+         ++funcIter) {
+        if (!funcIter->isDeclaration()) {
+            bbCount += funcIter->size();
+        }
+    }
+    if (weights.empty()) {
+        defaultWeights.resize(bbCount, 1);
+        blockWeights = &defaultWeights;
+    } else if (weights.size() != bbCount) {
+        errs() << "Basic blocks and configurations don't match: "
+               << bbCount << " and " << weights.size() << '\n';
+        delete mod;
+        return -1;
+    }
+
+    int traceCount = 0;
+    std::list<size_t>::const_iterator w = blockWeights->begin();
+    for (funcIter = mod->getFunctionList().begin(); funcIter != funcEnd;
+         ++funcIter) {
+        if (funcIter->isDeclaration()) {
+            continue;
+        }
+        std::list<block_array> traces;
+        std::list<std::vector<size_t> > traceWeights;
+        formTraces(*funcIter, w, traces, traceWeights);
+
+        std::list<block_array>::iterator t = traces.begin(), te = traces.end();
+        std::list<std::vector<size_t> >::iterator tw = traceWeights.begin();
+        for (; t != te; ++t, ++tw, ++traceCount) {
+            nodeWeights.push_back(std::vector<size_t>());
+            buffer.push_back(parseTrace(*t, *tw, &nodeWeights.back(),
+                                        values));
+        }
+    }
+
+    if (module) {
+        *module = mod;
+    } else {
+        delete mod;
+    }
+    return traceCount;
+}
+
 #define PARSE_MISO_POS                        \
     errs() << path << ": At line " << lineNum \
            << ", token " << tokenNum << ": "
 
 int ParseMISO(llvm::Twine path, std::list<NodeArray *> &buffer)
 {
+    AISE_TIMER(ParseTimer);
     OwningPtr<MemoryBuffer> fileBuffer;
     error_code getFileErr = MemoryBuffer::getFile(path, fileBuffer);
     if (getFileErr != error_code::success()) {
@@ -162,8 +399,8 @@ int ParseMISO(llvm::Twine path, std::list<NodeArray *> &buffer)
         // RPN holds nodes in the same order as in input text. There may be
         // replicated nodes when meets an "@".
         NodeArray RPN, stack;
-        // DAG is the formal representation of the instruction. It contains
-        // invisible nodes like ordering labels.
+        // DAG is the formal representation of the instruction, where each
+        // node appears once.
         NodeArray *DAG = new NodeArray();
 
         for (tokenNum = 1; line >> token; tokenNum++) {
@@ -209,12 +446,24 @@ int ParseMISO(llvm::Twine path, std::list<NodeArray *> &buffer)
             }
         }
 
-        if (stack.size() > 1) {
+        if (stack.empty()) {
             tokenNum--;
-            PARSE_MISO_POS << "Too many outputs\n";
+            PARSE_MISO_POS << "No output\n";
             return -1;
         }
 
+        // Values left on the stack are outputs. For multi-output
+        // instructions, mark each output with a virtual successor at the
+        // end of DAG, like the external uses in a basic block.
+        if (stack.size() > 1) {
+            NodeArray::iterator i = stack.begin(), e = stack.end();
+            for (; i != e; ++i) {
+                Node *virtSucc = new Node();
+                virtSucc->AddPred(*i);
+                DAG->push_back(virtSucc);
+            }
+        }
+
         LegalizeDAG(DAG);
         buffer.push_back(DAG);
     }
@@ -225,6 +474,7 @@ int ParseMISO(llvm::Twine path, std::list<NodeArray *> &buffer)
 
 int ParseConf(llvm::Twine path, std::list<size_t> &buffer)
 {
+    AISE_TIMER(ParseTimer);
     OwningPtr<MemoryBuffer> fileBuffer;
     error_code getFileErr = MemoryBuffer::getFile(path, fileBuffer);
     if (getFileErr != error_code::success()) {
@@ -267,6 +517,54 @@ int ParseConf(llvm::Twine path, std::list<size_t> &buffer)
     return lineNum;
 }
 
+#define PARSE_MANIFEST_POS errs() << path << ": At line " << lineNum << ": "
+
+int ParseManifest(llvm::Twine path, std::vector<ManifestEntry> &buffer)
+{
+    OwningPtr<MemoryBuffer> fileBuffer;
+    error_code getFileErr = MemoryBuffer::getFile(path, fileBuffer);
+    if (getFileErr != error_code::success()) {
+        errs() << path << ": " << getFileErr.message() << '\n';
+        return -1;
+    }
+    StringRef fileRef = fileBuffer->getBuffer(), lineRef;
+    size_t EOL = 0, lineNum = 1, count = 0;
+
+    for (; EOL != StringRef::npos; lineNum++) {
+        size_t nextEOL = fileRef.find('\n', EOL);
+        if (nextEOL == StringRef::npos) { // last line
+            lineRef = fileRef.substr(EOL);
+            EOL = nextEOL;
+        } else {
+            lineRef = fileRef.substr(EOL, nextEOL - EOL);
+            EOL = nextEOL + 1;
+        }
+
+        SmallVector<StringRef, 3> fields;
+        lineRef.trim().split(fields, " ", -1, false);
+        if (fields.empty()) {
+            continue;
+        }
+        if (fields.size() < 2 || fields.size() > 3) {
+            PARSE_MANIFEST_POS << "Expected <weight> <bitcode> [<bcconf>]\n";
+            return -1;
+        }
+
+        ManifestEntry entry;
+        if (ParseInt(fields[0].str(), entry.Weight) < 0 || entry.Weight < 0) {
+            PARSE_MANIFEST_POS << "Invalid weight: " << fields[0] << '\n';
+            return -1;
+        }
+        entry.Bitcode = fields[1].str();
+        if (fields.size() == 3) {
+            entry.Conf = fields[2].str();
+        }
+        buffer.push_back(entry);
+        count++;
+    }
+    return count;
+}
+
 int ParseInt(const std::string &str, int &buffer)
 {
     if (str.empty()) {
@@ -300,10 +598,25 @@ int ParseInt(const std::string &str, int &buffer)
 
 std::string ToString(int a)
 {
-    std::stringstream buf;
-    buf.clear();
-    buf << a;
-    return buf.str();
+    std::string buf;
+    if (a < 0) {
+        buf.push_back('-');
+        AppendInt(buf, -(long)a);
+    } else {
+        AppendInt(buf, a);
+    }
+    return buf;
+}
+
+void AppendInt(std::string &buffer, size_t a)
+{
+    char digits[24];
+    char *p = digits + sizeof(digits);
+    do {
+        *--p = '0' + a % 10;
+        a /= 10;
+    } while (a > 0);
+    buffer.append(p, digits + sizeof(digits));
 }
 
 OutFile::OutFile(const char *path)
@@ -324,8 +637,33 @@ OutFile::~OutFile()
     out = NULL;
 }
 
-Permutation::Permutation(size_t n)
+std::vector<std::vector<size_t> >
+    Permutation::listed[Permutation::maxListed + 1];
+const bool Permutation::ready = Permutation::listAll();
+
+bool Permutation::listAll()
+{
+    // Lists are filled after they're generated, so that the permutations
+    // generating them don't step through them.
+    for (size_t n = 1; n <= maxListed; n++) {
+        std::vector<std::vector<size_t> > list;
+        Permutation perm(n);
+        while (perm.HasNext()) {
+            list.push_back(perm.Next());
+        }
+        listed[n].swap(list);
+    }
+    return true;
+}
+
+Permutation::Permutation(size_t n) : next(NULL), end(NULL)
 {
+    if (n <= maxListed && !listed[n].empty()) {
+        next = &listed[n].front();
+        end = next + listed[n].size();
+        return;
+    }
+
     index.resize(n);
     for (size_t i = 0; i < n; i++) {
         index[i] = i;
@@ -338,6 +676,10 @@ Permutation::Permutation(size_t n)
 
 const std::vector<size_t> &Permutation::Next()
 {
+    if (next) {
+        return *next++;
+    }
+
     // push status until full
     while (status.size() < index.size()) {
         status.push_back(0);
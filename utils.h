@@ -2,18 +2,41 @@
 #define AISE_UTILS_H
 
 #include "node.h"
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/Twine.h"
+#include "llvm/IR/Module.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/ToolOutputFile.h"
 
 namespace aise
 {
 
+// NodeValueMap maps nodes parsed from bitcode to their values, so that
+// the module can be rewritten by the DAGs. Virtual successors have no
+// values.
+typedef llvm::DenseMap<const Node *, llvm::Value *> NodeValueMap;
+
 // ReadBitcode parses bitcode file as DAGs.
+// If module is not NULL, the parsed module is saved in it and values of
+// nodes are saved in values. Otherwise the module is dropped.
+// Returns the number of parsed DAGs, -1 if there is any error.
+int ParseBitcode(llvm::Twine path, std::list<NodeArray *> &buffer,
+                 llvm::Module **module = NULL, NodeValueMap *values = NULL);
+
+// ParseTraces parses bitcode file as DAGs of hot traces (superblocks).
+// Blocks are grouped by weights from ParseConf, or weigh 1 if weights is
+// empty. Weights of the blocks that nodes come from are saved in
+// nodeWeights, parallel to each DAG. module and values are the same as
+// for ParseBitcode.
 // Returns the number of parsed DAGs, -1 if there is any error.
-int ParseBitcode(llvm::Twine path, std::list<NodeArray *> &buffer);
+int ParseTraces(llvm::Twine path, const std::list<size_t> &weights,
+                std::list<NodeArray *> &buffer,
+                std::list<std::vector<size_t> > &nodeWeights,
+                llvm::Module **module = NULL, NodeValueMap *values = NULL);
 
 // ParseMISO parses the miso file with each instruction as a DAG.
+// Instructions with more than one output end with a virtual successor
+// for each output, in the order of outputs.
 // Returns the number of instructions loaded, -1 if there is any error.
 int ParseMISO(llvm::Twine path, std::list<NodeArray *> &buffer);
 
@@ -23,12 +46,28 @@ NodeArray *ParseMISO(const std::string &RefRPN);
 // Returns the number of configurations loaded, -1 if there is any error.
 int ParseConf(llvm::Twine path, std::list<size_t> &buffer);
 
+// ManifestEntry is an application of a manifest, weighted among others.
+struct ManifestEntry {
+    int Weight;
+    std::string Bitcode;
+    std::string Conf; // empty if there is no conf
+};
+
+// ParseManifest parses the manifest of applications, where each line is
+// "<weight> <bitcode> [<bcconf>]" separated by spaces. Paths are relative
+// to the working directory.
+// Returns the number of applications loaded, -1 if there is any error.
+int ParseManifest(llvm::Twine path, std::vector<ManifestEntry> &buffer);
+
 // ParseInt parses str as an int and saves it into buffer.
 // Returns -1 if there is any error, 0 otherwise.
 int ParseInt(const std::string &str, int &buffer);
 
 std::string ToString(int a);
 
+// AppendInt appends the decimal digits of a to buffer without streams.
+void AppendInt(std::string &buffer, size_t a);
+
 // OutFile provides a writer interface that automatically flushes content
 // when deconstructed. It's recommanded to use in a braced context.
 class OutFile
@@ -49,10 +88,19 @@ class Permutation
     std::vector<size_t> index;
     std::vector<size_t> status;
 
+    // Permutations of up to maxListed indexes are listed once at startup,
+    // in the order Next gives them, since yield walks them for every cut.
+    // Such a permutation only steps through its list.
+    static const size_t maxListed = 4;
+    static std::vector<std::vector<size_t> > listed[maxListed + 1];
+    static const bool ready;
+    static bool listAll();
+    const std::vector<size_t> *next, *end;
+
   public:
     Permutation(size_t n);
 
-    bool HasNext() const { return !status.empty(); }
+    bool HasNext() const { return next ? next != end : !status.empty(); }
     // Next returns a permutation of indexes {0, 1, ..., n - 1}.
     const std::vector<size_t> &Next();
 };